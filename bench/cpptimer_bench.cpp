@@ -0,0 +1,200 @@
+// Overhead of tic/toc and aggregate(), measured with Google Benchmark.
+/*
+g++ -std=c++17 -O2 -fopenmp -I.. cpptimer_bench.cpp \
+    -lbenchmark -lpthread -o cpptimer_bench
+./cpptimer_bench --benchmark_counters_tabular=true
+*/
+
+#include "../cpptimer.h"
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+#include <vector>
+
+// Tags of the form "tag_0", "tag_1", ... and their handles
+static const vector<string> &tag_names(int count)
+{
+  static map<int, vector<string>> cache;
+  vector<string> &names = cache[count];
+  for (int i = names.size(); i < count; i++)
+  {
+    names.push_back("tag_" + to_string(i));
+  }
+  return names;
+}
+
+static vector<TagHandle> tag_handles(int count)
+{
+  vector<TagHandle> handles;
+  for (const string &name : tag_names(count))
+  {
+    handles.push_back(CppTimer::handle(name));
+  }
+  return handles;
+}
+
+// A tic/toc pair with the string API, cycling through state.range(0) tags
+template <class Timer>
+static void BM_TicTocString(benchmark::State &state)
+{
+  const vector<string> &names = tag_names(state.range(0));
+  Timer timer;
+  timer.lockfree();
+  timer.streaming = true;
+  unsigned long int i = 0;
+  for (auto _ : state)
+  {
+    const string &name = names[i++ % names.size()];
+    timer.tic(string(name));
+    timer.toc(string(name));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// A tic/toc pair with handles, cycling through state.range(0) tags
+template <class Timer>
+static void BM_TicTocHandle(benchmark::State &state)
+{
+  vector<TagHandle> handles = tag_handles(state.range(0));
+  Timer timer;
+  timer.lockfree();
+  timer.streaming = true;
+  unsigned long int i = 0;
+  for (auto _ : state)
+  {
+    TagHandle handle = handles[i++ % handles.size()];
+    timer.tic(handle);
+    timer.toc(handle);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Same as BM_TicTocHandle, but through the critical section
+static void BM_TicTocLocked(benchmark::State &state)
+{
+  vector<TagHandle> handles = tag_handles(state.range(0));
+  CppTimer timer;
+  timer.streaming = true;
+  unsigned long int i = 0;
+  for (auto _ : state)
+  {
+    TagHandle handle = handles[i++ % handles.size()];
+    timer.tic(handle);
+    timer.toc(handle);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Samples are stored instead of summarised in toc
+static void BM_TicTocBuffered(benchmark::State &state)
+{
+  TagHandle handle = CppTimer::handle("buffered");
+  CppTimer timer;
+  timer.lockfree();
+  for (auto _ : state)
+  {
+    timer.tic(handle);
+    timer.toc(handle);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_ScopedTimer(benchmark::State &state)
+{
+  TagHandle handle = CppTimer::handle("scoped");
+  CppTimer timer;
+  timer.lockfree();
+  timer.streaming = true;
+  for (auto _ : state)
+  {
+    CppTimer::ScopedTimer scoped(timer, handle);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_ScopedTimerString(benchmark::State &state)
+{
+  CppTimer timer;
+  timer.lockfree();
+  timer.streaming = true;
+  for (auto _ : state)
+  {
+    CppTimer::ScopedTimer scoped(timer, "scoped");
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// state.range(0) OpenMP threads doing tic/toc pairs at the same time, with
+// per-thread buffers (state.range(1) == 1) or the critical section
+static void BM_Threads(benchmark::State &state)
+{
+  const int threads = state.range(0);
+  const int pairs = 10000;
+  TagHandle handle = CppTimer::handle("threads");
+  CppTimer timer;
+  if (state.range(1))
+  {
+    timer.lockfree(threads);
+  }
+  timer.streaming = true;
+  for (auto _ : state)
+  {
+#pragma omp parallel num_threads(threads)
+    for (int i = 0; i < pairs; i++)
+    {
+      timer.tic(handle);
+      timer.toc(handle);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * pairs * threads);
+}
+
+// aggregate() over state.range(0) buffered samples spread over
+// state.range(1) tags
+static void BM_Aggregate(benchmark::State &state)
+{
+  const long int samples = state.range(0);
+  vector<TagHandle> handles = tag_handles(state.range(1));
+  CppTimer timer;
+  timer.lockfree();
+  for (auto _ : state)
+  {
+    state.PauseTiming();
+    for (long int i = 0; i < samples; i++)
+    {
+      TagHandle handle = handles[i % handles.size()];
+      timer.tic(handle);
+      timer.toc(handle);
+    }
+    state.ResumeTiming();
+    benchmark::DoNotOptimize(timer.aggregate());
+  }
+  state.SetItemsProcessed(state.iterations() * samples);
+}
+
+BENCHMARK_TEMPLATE(BM_TicTocString, CppTimer)->Arg(1)->Arg(10000);
+BENCHMARK_TEMPLATE(BM_TicTocHandle, CppTimer)->Arg(1)->Arg(10000);
+BENCHMARK_TEMPLATE(BM_TicTocHandle, BasicCppTimer<steady_clock>)->Arg(1);
+#ifdef __linux__
+BENCHMARK_TEMPLATE(BM_TicTocHandle, BasicCppTimer<coarse_clock>)->Arg(1);
+#endif
+#ifdef CPPTIMER_HAS_TSC
+BENCHMARK_TEMPLATE(BM_TicTocHandle, BasicCppTimer<tsc_clock>)->Arg(1);
+#endif
+BENCHMARK_TEMPLATE(BM_TicTocHandle, BasicCppTimer<high_resolution_clock,
+                                                  false>)
+    ->Arg(1);
+BENCHMARK(BM_TicTocLocked)->Arg(1)->Arg(10000);
+BENCHMARK(BM_TicTocBuffered);
+BENCHMARK(BM_ScopedTimer);
+BENCHMARK(BM_ScopedTimerString);
+BENCHMARK(BM_Threads)
+    ->ArgsProduct({benchmark::CreateRange(1, omp_get_max_threads(), 2),
+                   {0, 1}})
+    ->UseRealTime();
+BENCHMARK(BM_Aggregate)
+    ->ArgsProduct({benchmark::CreateRange(1000, 10000000, 100), {1, 10000}})
+    ->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
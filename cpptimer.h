@@ -5,128 +5,3738 @@
 #include <omp.h>
 #endif
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <numeric>
+#include <ostream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
 #include <vector>
 #include <map>
 #include <set>
 
+#if defined(__unix__) || defined(__APPLE__)
+#define CPPTIMER_HAS_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+#define CPPTIMER_HAS_TSC
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
+#ifdef __linux__
+#include <dirent.h>
+#include <sched.h>
+#endif
+
+#if defined(__linux__) && __has_include(<linux/perf_event.h>)
+#define CPPTIMER_HAS_PERF
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #ifndef _OPENMP
 inline int omp_get_thread_num() { return 0; }
+inline int omp_get_max_threads() { return 1; }
+inline int omp_get_level() { return 0; }
 #endif
 
 using namespace std;
 using namespace chrono;
 
-using keypair = pair<string, unsigned int>;
 using statistics = tuple<double, double, double, double, unsigned long int>;
+// Call tree data: Inclusive, Exclusive (total nanoseconds), Count
+using tree_statistics = tuple<double, double, unsigned long int>;
+// Hardware counters: Cycles, Instructions, Cache misses, Branch misses
+using counter_values = array<uint64_t, 4>;
+// Per-call means of the hardware counters and the number of calls
+using counter_statistics =
+    tuple<double, double, double, double, unsigned long int>;
+// Heap use per call: Mean bytes allocated, Mean allocations, Peak of the
+// live bytes above the start of the call, Count
+using allocation_statistics =
+    tuple<double, double, double, unsigned long int>;
+// Outlier-resistant estimates: Median, MAD, Trimmed mean (nanoseconds) and
+// the number of rejected samples
+using robust_statistics = tuple<double, double, double, unsigned long int>;
 
-class CppTimer
+// Small integer identifying a tag. Handles are shared by all timers.
+struct TagHandle
 {
-protected:
-  map<keypair, high_resolution_clock::time_point> tics; // Map of start times
-  set<string> missing_tics, needless_tocs;              // Set of missing tics
-  // Data to be returned: Tag, Mean, SD, Min, Max, Count
-  map<string, statistics> data;
+  unsigned int id;
+};
+
+// Define CPPTIMER_DISABLE to turn all timers into empty stubs that cost
+// nothing at run time, so the instrumentation can stay in release builds
+#ifdef CPPTIMER_DISABLE
+inline constexpr bool cpptimer_enabled = false;
+#else
+inline constexpr bool cpptimer_enabled = true;
+#endif
+
+// Handle of a string literal, registered once per call site
+#ifndef CPPTIMER_DISABLE
+#define CPPTIMER_TAG(tag)                                          \
+  ([]() {                                                          \
+    static const TagHandle tag_handle = CppTimerBase::handle(tag); \
+    return tag_handle;                                             \
+  }())
+#else
+#define CPPTIMER_TAG(tag) (TagHandle{0})
+#endif
+
+// Clock sources besides the ones of <chrono>. A clock whose tick length is
+// only known at run time provides ns_per_tick().
+#ifdef __linux__
+// CLOCK_MONOTONIC_COARSE: cheapest to read, resolution of a scheduler tick
+struct coarse_clock
+{
+  using rep = int64_t;
+  using period = nano;
+  using duration = chrono::duration<rep, period>;
+  using time_point = chrono::time_point<coarse_clock>;
+  static constexpr bool is_steady = true;
+
+  static time_point now() noexcept
+  {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return time_point(duration(ts.tv_sec * 1000000000LL + ts.tv_nsec));
+  }
+};
+#endif
+
+#ifdef CPPTIMER_HAS_TSC
+// Invariant time stamp counter. Ticks are cycles, not seconds.
+struct tsc_clock
+{
+  using rep = int64_t;
+  using period = ratio<1>;
+  using duration = chrono::duration<rep, period>;
+  using time_point = chrono::time_point<tsc_clock>;
+  static constexpr bool is_steady = true;
+
+  static time_point now() noexcept
+  {
+    unsigned int aux;
+    return time_point(duration(__rdtscp(&aux)));
+  }
+
+  // Calibrated against steady_clock once per process
+  static double ns_per_tick()
+  {
+    static const double ns = []()
+    {
+      steady_clock::time_point start = steady_clock::now();
+      rep cycles = now().time_since_epoch().count();
+      while (steady_clock::now() - start < milliseconds(20))
+        ;
+      cycles = now().time_since_epoch().count() - cycles;
+      nanoseconds elapsed = steady_clock::now() - start;
+      return double(elapsed.count()) / cycles;
+    }();
+    return ns;
+  }
+};
+#endif
+
+// Length of a tick of Clock in nanoseconds
+template <class Clock, class = void>
+struct clock_scale
+{
+  static double ns_per_tick()
+  {
+    return 1e9 * Clock::period::num / Clock::period::den;
+  }
+
+  // Exact for timestamps, where the double product would lose precision
+  static int64_t to_ns(int64_t ticks)
+  {
+    typename Clock::duration duration(ticks);
+    return duration_cast<nanoseconds>(duration).count();
+  }
+};
+
+template <class Clock>
+struct clock_scale<Clock, void_t<decltype(Clock::ns_per_tick())>>
+{
+  static double ns_per_tick() { return Clock::ns_per_tick(); }
+  static int64_t to_ns(int64_t ticks)
+  {
+    return llround(ticks * ns_per_tick());
+  }
+};
+
+// Group of hardware counters of the calling thread, opened with the first
+// read and read with a single system call. read() returns false without
+// perf_event_open or if the kernel refuses any of the counters.
+class PerfCounters
+{
+private:
+  array<int, 4> fds{-1, -1, -1, -1};
+  bool opened = false;
+
+  void close()
+  {
+#ifdef CPPTIMER_HAS_PERF
+    for (int &fd : fds)
+    {
+      if (fd >= 0)
+      {
+        ::close(fd);
+      }
+      fd = -1;
+    }
+#endif
+  }
+
+  void open()
+  {
+    opened = true;
+#ifdef CPPTIMER_HAS_PERF
+    static const uint64_t events[4] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+    for (unsigned int i = 0; i < fds.size(); i++)
+    {
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.size = sizeof(attr);
+      attr.config = events[i];
+      attr.read_format = PERF_FORMAT_GROUP;
+      attr.disabled = i == 0;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1,
+                       i ? fds[0] : -1, 0);
+      if (fds[i] < 0)
+      {
+        close();
+        return;
+      }
+    }
+    ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+  }
 
 public:
-  vector<string> tags;      // Vector of identifiers
-  vector<double> durations; // Vector of durations
-  bool verbose = true;      // Print warnings about not stopped timers
+  PerfCounters() {}
+  PerfCounters(const PerfCounters &) = delete;
+  PerfCounters &operator=(const PerfCounters &) = delete;
+  PerfCounters(PerfCounters &&other) noexcept
+      : fds(other.fds), opened(other.opened)
+  {
+    other.fds.fill(-1);
+    other.opened = false;
+  }
+  PerfCounters &operator=(PerfCounters &&other) noexcept
+  {
+    swap(fds, other.fds);
+    swap(opened, other.opened);
+    return *this;
+  }
+  ~PerfCounters() { close(); }
 
-  // This ensures that there are no implicit conversions in the constructors
-  // That means, the types must exactly match the constructor signature
-  template <typename T>
-  CppTimer(T &&) = delete;
+  // The group of the calling thread, as threads may share a buffer. Closed
+  // when the thread exits.
+  static PerfCounters &local()
+  {
+    thread_local PerfCounters counters;
+    return counters;
+  }
+
+  bool read(counter_values &values)
+  {
+    if (!opened)
+    {
+      open();
+    }
+    if (fds[0] < 0)
+    {
+      return false;
+    }
+#ifdef CPPTIMER_HAS_PERF
+    struct
+    {
+      uint64_t count;
+      uint64_t values[4];
+    } group;
+    if (::read(fds[0], &group, sizeof(group)) != ssize_t(sizeof(group)))
+    {
+      return false;
+    }
+    copy(begin(group.values), end(group.values), begin(values));
+    return true;
+#else
+    return false;
+#endif
+  }
+};
+
+// Heap allocations of the calling thread. Only counted if exactly one
+// translation unit defines CPPTIMER_TRACK_ALLOCATIONS before including this
+// header, which replaces the global operator new and delete there.
+struct AllocationCounters
+{
+  uint64_t bytes, count; // Requested bytes and calls to new
+  int64_t live, peak;    // Usable bytes not freed yet, and their maximum
+};
+inline thread_local AllocationCounters cpptimer_allocations = {0, 0, 0, 0};
 
-  CppTimer() {}
-  CppTimer(bool verbose) : verbose(verbose) {}
+#ifdef CPPTIMER_TRACK_ALLOCATIONS
+#include <cstdlib>
+#include <new>
+#if defined(__APPLE__)
+#include <malloc/malloc.h>
+#define CPPTIMER_USABLE_SIZE malloc_size
+#elif defined(__linux__)
+#include <malloc.h>
+#define CPPTIMER_USABLE_SIZE malloc_usable_size
+#else
+#error "CPPTIMER_TRACK_ALLOCATIONS needs malloc_usable_size or malloc_size"
+#endif
 
-  // start a timer - save time
-  void tic(string &&tag = "tictoc")
+static void *cpptimer_allocate(size_t size, size_t alignment, bool nothrow)
+{
+  void *block = nullptr;
+  if (alignment <= alignof(max_align_t))
   {
-    keypair key(std::move(tag), omp_get_thread_num());
+    block = malloc(size ? size : 1);
+  }
+  else if (posix_memalign(&block, alignment, size ? size : 1) != 0)
+  {
+    block = nullptr;
+  }
+  if (!block)
+  {
+    if (nothrow)
+    {
+      return nullptr;
+    }
+    throw bad_alloc();
+  }
+  AllocationCounters &counters = cpptimer_allocations;
+  counters.bytes += size, counters.count++;
+  counters.live += CPPTIMER_USABLE_SIZE(block);
+  counters.peak = std::max(counters.peak, counters.live);
+  return block;
+}
 
-#pragma omp critical
-    tics[key] = high_resolution_clock::now();
+static void cpptimer_free(void *block) noexcept
+{
+  if (block)
+  {
+    cpptimer_allocations.live -= CPPTIMER_USABLE_SIZE(block);
+    free(block);
   }
+}
 
-  // stop a timer - calculate time difference and save key
-  void toc(string &&tag = "tictoc")
+void *operator new(size_t size) { return cpptimer_allocate(size, 0, false); }
+void *operator new[](size_t size)
+{
+  return cpptimer_allocate(size, 0, false);
+}
+void *operator new(size_t size, const nothrow_t &) noexcept
+{
+  return cpptimer_allocate(size, 0, true);
+}
+void *operator new[](size_t size, const nothrow_t &) noexcept
+{
+  return cpptimer_allocate(size, 0, true);
+}
+void *operator new(size_t size, align_val_t alignment)
+{
+  return cpptimer_allocate(size, size_t(alignment), false);
+}
+void *operator new[](size_t size, align_val_t alignment)
+{
+  return cpptimer_allocate(size, size_t(alignment), false);
+}
+void *operator new(size_t size, align_val_t alignment,
+                   const nothrow_t &) noexcept
+{
+  return cpptimer_allocate(size, size_t(alignment), true);
+}
+void *operator new[](size_t size, align_val_t alignment,
+                     const nothrow_t &) noexcept
+{
+  return cpptimer_allocate(size, size_t(alignment), true);
+}
+void operator delete(void *block) noexcept { cpptimer_free(block); }
+void operator delete[](void *block) noexcept { cpptimer_free(block); }
+void operator delete(void *block, size_t) noexcept { cpptimer_free(block); }
+void operator delete[](void *block, size_t) noexcept { cpptimer_free(block); }
+void operator delete(void *block, const nothrow_t &) noexcept
+{
+  cpptimer_free(block);
+}
+void operator delete[](void *block, const nothrow_t &) noexcept
+{
+  cpptimer_free(block);
+}
+void operator delete(void *block, align_val_t) noexcept
+{
+  cpptimer_free(block);
+}
+void operator delete[](void *block, align_val_t) noexcept
+{
+  cpptimer_free(block);
+}
+void operator delete(void *block, size_t, align_val_t) noexcept
+{
+  cpptimer_free(block);
+}
+void operator delete[](void *block, size_t, align_val_t) noexcept
+{
+  cpptimer_free(block);
+}
+void operator delete(void *block, align_val_t, const nothrow_t &) noexcept
+{
+  cpptimer_free(block);
+}
+void operator delete[](void *block, align_val_t, const nothrow_t &) noexcept
+{
+  cpptimer_free(block);
+}
+#endif
+
+// Barriers for benchmarks: do_not_optimize() makes the compiler assume that
+// value is read, clobber_memory() that all memory is read and written
+#if defined(__GNUC__) || defined(__clang__)
+template <class T>
+inline void do_not_optimize(const T &value)
+{
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+inline void clobber_memory() { asm volatile("" : : : "memory"); }
+#else
+template <class T>
+inline void do_not_optimize(const T &value)
+{
+  const volatile char *sink = reinterpret_cast<const volatile char *>(&value);
+  (void)*sink;
+  atomic_signal_fence(memory_order_seq_cst);
+}
+inline void clobber_memory() { atomic_signal_fence(memory_order_seq_cst); }
+#endif
+
+// Log-bucketed histogram of durations in nanoseconds. Each power of two is
+// split into 32 buckets, so quantiles have a relative error below 1/32.
+// Memory is fixed (15 KB), independent of the number of samples.
+class Histogram
+{
+private:
+  static constexpr unsigned int bits = 5;
+  static constexpr unsigned int sub = 1u << bits;
+  static constexpr unsigned int size = sub + (64 - bits) * sub;
+  vector<uint64_t> counts; // Allocated with the first sample
+  uint64_t total = 0;
+
+  static unsigned int bucket(double ns)
+  {
+    if (!(ns >= 1))
+    {
+      return 0;
+    }
+    uint64_t value = ns < 0x1p64 ? uint64_t(ns) : ~uint64_t(0);
+    if (value < sub)
+    {
+      return value;
+    }
+    unsigned int exponent = 63;
+    while (!(value >> exponent))
+    {
+      exponent--;
+    }
+    unsigned int shift = exponent - bits;
+    return sub + shift * sub + unsigned((value >> shift) - sub);
+  }
+
+  // Smallest value and width of a bucket
+  static pair<double, double> range(unsigned int index)
+  {
+    if (index < sub)
+    {
+      return {index, 1};
+    }
+    unsigned int shift = (index - sub) / sub;
+    double width = ldexp(1, shift);
+    return {(sub + (index - sub) % sub) * width, width};
+  }
+
+public:
+  void record(double ns)
   {
+    if (counts.empty())
+    {
+      counts.resize(size);
+    }
+    counts[bucket(ns)]++;
+    total++;
+  }
+
+  void merge(const Histogram &other)
+  {
+    if (other.counts.empty())
+    {
+      return;
+    }
+    if (counts.empty())
+    {
+      counts.resize(size);
+    }
+    for (unsigned int i = 0; i < size; i++)
+    {
+      counts[i] += other.counts[i];
+    }
+    total += other.total;
+  }
+
+  uint64_t count() const { return total; }
+
+  // Linearly interpolated within the bucket, NaN without samples
+  double quantile(double q) const
+  {
+    double target = std::min(std::max(q, 0.0), 1.0) * count();
+    double seen = 0;
+    for (unsigned int i = 0; i < counts.size(); i++)
+    {
+      if (counts[i] && seen + counts[i] >= target)
+      {
+        auto [lower, width] = range(i);
+        return lower + width * (target - seen) / counts[i];
+      }
+      seen += counts[i];
+    }
+    return numeric_limits<double>::quiet_NaN();
+  }
 
-    keypair key(std::move(tag), omp_get_thread_num());
+  // Number of samples below ns, linearly interpolated within the bucket
+  double rank(double ns) const
+  {
+    if (counts.empty() || !(ns > 0))
+    {
+      return 0;
+    }
+    unsigned int index = bucket(ns);
+    double seen = 0;
+    for (unsigned int i = 0; i < index; i++)
+    {
+      seen += counts[i];
+    }
+    auto [lower, width] = range(index);
+    double fraction = std::min(std::max((ns - lower) / width, 0.0), 1.0);
+    return seen + fraction * counts[index];
+  }
 
-#pragma omp critical
+  // Median absolute deviation from median, unscaled (1.4826 times it
+  // estimates the standard deviation of a normal distribution). Found by
+  // bisection on the mass within median +- deviation, NaN without samples.
+  double mad(double median) const
+  {
+    double half = count() / 2.0, lower = 0, upper = 1;
+    if (half == 0)
+    {
+      return numeric_limits<double>::quiet_NaN();
+    }
+    while (rank(median + upper) - rank(median - upper) < half &&
+           upper < 0x1p64)
+    {
+      upper *= 2;
+    }
+    for (int i = 0; i < 64 && upper - lower > 1e-3 * upper; i++)
     {
-      if (auto tic{tics.find(key)}; tic != end(tics))
+      double middle = (lower + upper) / 2;
+      if (rank(median + middle) - rank(median - middle) < half)
       {
-        nanoseconds duration = high_resolution_clock::now() -
-                               std::move(tic->second);
-        durations.push_back(duration.count());
-        tic->second = tic->second.max();
-        tags.push_back(std::move(key.first));
+        lower = middle;
       }
       else
       {
-        missing_tics.insert(std::move(key.first));
+        upper = middle;
       }
     }
+    return (lower + upper) / 2;
   }
 
-  class ScopedTimer
+  // Mean without the shortest and the longest fraction trim of the samples,
+  // assuming they are spread evenly within each bucket. NaN without samples.
+  double trimmed_mean(double trim) const
   {
-  private:
-    CppTimer &timer;
-    string tag;
-
-  public:
-    ScopedTimer(CppTimer &timer, string tag = "scoped") : timer(timer), tag(tag)
+    trim = std::min(std::max(trim, 0.0), 0.5);
+    double first = trim * total, last = total - first, seen = 0, sum = 0;
+    if (!(last > first))
     {
-      timer.tic(string(tag));
+      return trim < 0.5 ? numeric_limits<double>::quiet_NaN()
+                        : quantile(0.5);
     }
-    ~ScopedTimer()
+    for (unsigned int i = 0; i < counts.size() && seen < last; i++)
     {
-      timer.toc(string(tag));
+      double c = counts[i];
+      double a = std::max(first - seen, 0.0), b = std::min(last - seen, c);
+      if (c && b > a)
+      {
+        auto [lower, width] = range(i);
+        sum += (b - a) * (lower + width * (a + b) / (2 * c));
+      }
+      seen += c;
     }
-  };
+    return sum / (last - first);
+  }
 
-  map<string, statistics> aggregate()
+  // Zero the counts, keeping the memory
+  void clear()
   {
-    // Calculate summary statistics
-    for (unsigned long int i = 0; i < tags.size(); i++)
+    fill(begin(counts), end(counts), 0);
+    total = 0;
+  }
+};
+
+// What a full RingBuffer does with a new element
+enum class Overflow
+{
+  overwrite_oldest,
+  drop_newest
+};
+
+// Fixed-capacity ring buffer. Memory is only allocated by allocate(), so
+// pushing never allocates.
+template <class T>
+class RingBuffer
+{
+private:
+  vector<T> items;
+  unsigned long int head = 0, length = 0, dropped = 0;
+  Overflow overflow = Overflow::overwrite_oldest;
+
+public:
+  void allocate(unsigned long int capacity, Overflow policy)
+  {
+    items.assign(capacity, T());
+    overflow = policy;
+    head = length = dropped = 0;
+  }
+
+  unsigned long int capacity() const { return items.size(); }
+  unsigned long int size() const { return length; }
+  // Number of elements overwritten or dropped because the buffer was full
+  unsigned long int lost() const { return dropped; }
+
+  void push(const T &item)
+  {
+    if (length == items.size())
     {
-      // Welford's online algorithm for mean and sst
-      // sst = sum of squared total deviations
-      double mean = 0, sst = 0, min = numeric_limits<double>::max(), max = 0;
-      unsigned long int count = 0;
-      if (auto entry{data.find(tags[i])}; entry != end(data))
+      dropped++;
+      if (overflow == Overflow::drop_newest || items.empty())
       {
-        tie(mean, sst, min, max, count) = entry->second;
+        return;
       }
-      count++;
-      double duration = durations[i];
-      if (duration < 0)
+    }
+    else
+    {
+      length++;
+    }
+    items[head] = item;
+    if (++head == items.size())
+    {
+      head = 0;
+    }
+  }
+
+  // Visit the elements from oldest to newest
+  template <class Function>
+  void for_each(Function function) const
+  {
+    if (length == 0)
+    {
+      return;
+    }
+    unsigned long int index = (head + items.size() - length) % items.size();
+    for (unsigned long int i = 0; i < length; i++)
+    {
+      function(items[index]);
+      if (++index == items.size())
       {
-        needless_tocs.insert(tags[i]);
-        continue;
+        index = 0;
       }
-      double delta = duration - mean;
-      mean += delta / count;
-      sst += delta * (duration - mean);
-      min = std::min(min, duration);
-      max = std::max(max, duration);
-      data[tags[i]] = {mean, sst, min, max, count};
     }
+  }
 
-    tags.clear(), durations.clear();
-    return (data);
+  void clear() { head = length = dropped = 0; }
+};
+
+// Wait-free queue for one producer and one consumer thread. The capacity
+// is rounded up to a power of two, push() fails instead of blocking when
+// the queue is full.
+template <class T>
+class SpscQueue
+{
+private:
+  struct State
+  {
+    vector<T> items;
+    unsigned long int mask;
+    alignas(64) atomic<unsigned long int> head{0}; // Written by the consumer
+    alignas(64) atomic<unsigned long int> tail{0}; // Written by the producer
+  };
+  unique_ptr<State> state;
+
+public:
+  void allocate(unsigned long int capacity)
+  {
+    unsigned long int size = 1;
+    while (size < capacity)
+    {
+      size *= 2;
+    }
+    state = make_unique<State>();
+    state->items.resize(size);
+    state->mask = size - 1;
   }
 
-  void reset()
+  void release() { state.reset(); }
+  bool active() const { return bool(state); }
+
+  bool push(const T &item)
+  {
+    unsigned long int tail = state->tail.load(memory_order_relaxed);
+    if (tail - state->head.load(memory_order_acquire) == state->items.size())
+    {
+      return false;
+    }
+    state->items[tail & state->mask] = item;
+    state->tail.store(tail + 1, memory_order_release);
+    return true;
+  }
+
+  // Pass all queued elements to function
+  template <class Function>
+  void drain(Function function)
   {
-    tics.clear(), durations.clear(), tags.clear(), data.clear();
+    unsigned long int head = state->head.load(memory_order_relaxed);
+    unsigned long int tail = state->tail.load(memory_order_acquire);
+    for (; head != tail; head++)
+    {
+      function(state->items[head & state->mask]);
+    }
+    state->head.store(head, memory_order_release);
   }
 };
 
+// Statistics by tag id, written by one thread at a time and copied by any
+// number of readers without locks (a seqlock). A reader retries if the
+// sequence number was odd or changed during its copy. Arrays outgrown by
+// the writer stay allocated until destruction, so a reader never touches
+// freed memory.
+class PublishedStatistics
+{
+private:
+  static constexpr unsigned int words = 5; // Per entry
+  atomic<uint64_t> sequence{0};
+  atomic<atomic<uint64_t> *> entries{nullptr};
+  atomic<size_t> size{0};
+  vector<unique_ptr<atomic<uint64_t>[]>> arrays;
+  size_t capacity = 0;
+
+  static uint64_t bits(double value)
+  {
+    uint64_t result;
+    memcpy(&result, &value, sizeof(result));
+    return result;
+  }
+  static double value(uint64_t bits)
+  {
+    double result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+  }
+
+public:
+  void publish(const vector<statistics> &stats)
+  {
+    uint64_t current = sequence.load(memory_order_relaxed);
+    sequence.store(current + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    if (stats.size() > capacity)
+    {
+      capacity = std::max(stats.size(), 2 * capacity);
+      arrays.push_back(make_unique<atomic<uint64_t>[]>(capacity * words));
+      entries.store(arrays.back().get(), memory_order_relaxed);
+    }
+    atomic<uint64_t> *out = entries.load(memory_order_relaxed);
+    for (size_t i = 0; i < stats.size(); i++)
+    {
+      auto [mean, sst, min, max, count] = stats[i];
+      out[i * words + 0].store(bits(mean), memory_order_relaxed);
+      out[i * words + 1].store(bits(sst), memory_order_relaxed);
+      out[i * words + 2].store(bits(min), memory_order_relaxed);
+      out[i * words + 3].store(bits(max), memory_order_relaxed);
+      out[i * words + 4].store(count, memory_order_relaxed);
+    }
+    // Release so that a reader seeing the size sees the array that holds it
+    size.store(stats.size(), memory_order_release);
+    sequence.store(current + 2, memory_order_release);
+  }
+
+  vector<statistics> read() const
+  {
+    vector<statistics> result;
+    read(result);
+    return result;
+  }
+
+  // Copy into result, which only allocates if it has to grow
+  void read(vector<statistics> &result) const
+  {
+    while (true)
+    {
+      uint64_t current = sequence.load(memory_order_acquire);
+      if (current & 1)
+      {
+        this_thread::yield();
+        continue;
+      }
+      size_t length = size.load(memory_order_acquire);
+      const atomic<uint64_t> *in = entries.load(memory_order_relaxed);
+      result.resize(length);
+      for (size_t i = 0; i < length; i++)
+      {
+        result[i] = {value(in[i * words + 0].load(memory_order_relaxed)),
+                     value(in[i * words + 1].load(memory_order_relaxed)),
+                     value(in[i * words + 2].load(memory_order_relaxed)),
+                     value(in[i * words + 3].load(memory_order_relaxed)),
+                     in[i * words + 4].load(memory_order_relaxed)};
+      }
+      atomic_thread_fence(memory_order_acquire);
+      if (sequence.load(memory_order_relaxed) == current)
+      {
+        return;
+      }
+    }
+  }
+};
+
+// Raw sample of the sample log, 16 bytes
+struct Sample
+{
+  uint32_t tag;      // Tag id
+  uint32_t thread;   // Thread that called toc
+  uint64_t duration; // Clock ticks in the log, nanoseconds in samples()
+};
+
+// Timestamped span of the trace, 24 bytes
+struct Span
+{
+  uint32_t tag;       // Tag id
+  uint32_t thread;    // Thread that called toc
+  int64_t start, end; // Clock ticks since the epoch of the clock
+};
+
+// Binary dump of timer results, see BasicCppTimer::dump(). Version 1:
+//   DumpHeader
+//   string table: uint64 offsets[tags + 1], chars[offsets[tags]]
+//   statistics:   uint32 tag, double mean, sst, min, max, uint64 count
+//   samples:      uint32 tag, uint32 thread, uint64 duration
+//   spans:        uint32 tag, uint32 thread, int64 start, int64 end
+// Each section stores one array per column, padded to 8 bytes. Tags are
+// indices into the string table, times are in nanoseconds. Integers are in
+// the byte order of the writer, which byte_order identifies.
+struct DumpHeader
+{
+  char magic[8];
+  uint32_t version, byte_order;
+  uint64_t tags, chars, stats, samples, spans;
+};
+
+// Read-only view of a column of a dump
+template <class T>
+struct Column
+{
+  using value_type = T;
+  const T *data = nullptr;
+  uint64_t size = 0;
+
+  const T &operator[](uint64_t i) const { return data[i]; }
+  const T *begin() const { return data; }
+  const T *end() const { return data + size; }
+};
+
+// Dump file mapped into memory, the columns point directly into the file
+class TimerDump
+{
+private:
+  const char *file = nullptr;
+  uint64_t length = 0;
+  vector<char> copy; // Used where mmap is not available
+  const uint64_t *offsets = nullptr;
+  const char *chars = nullptr;
+
+  void unmap()
+  {
+#ifdef CPPTIMER_HAS_MMAP
+    if (file && copy.empty())
+    {
+      munmap(const_cast<char *>(file), length);
+    }
+#endif
+    file = nullptr;
+  }
+
+public:
+  DumpHeader header{};
+  Column<uint32_t> stat_tag, sample_tag, sample_thread, span_tag, span_thread;
+  Column<double> mean, sst, min, max;
+  Column<uint64_t> count, sample_duration;
+  Column<int64_t> span_start, span_end;
+
+  static constexpr uint32_t version = 1, byte_order = 0x01020304;
+
+  explicit TimerDump(const string &path)
+  {
+#ifdef CPPTIMER_HAS_MMAP
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0)
+    {
+      if (fd >= 0)
+      {
+        close(fd);
+      }
+      throw runtime_error("cpptimer: can't open " + path);
+    }
+    length = info.st_size;
+    void *mapped = length ? mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0)
+                          : MAP_FAILED;
+    close(fd);
+    if (mapped == MAP_FAILED)
+    {
+      throw runtime_error("cpptimer: can't map " + path);
+    }
+    file = static_cast<const char *>(mapped);
+#else
+    ifstream in(path, ios::binary);
+    if (!in)
+    {
+      throw runtime_error("cpptimer: can't open " + path);
+    }
+    copy.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    file = copy.data(), length = copy.size();
+#endif
+
+    // Walk the sections, checking that each fits into the file
+    uint64_t position = sizeof(DumpHeader);
+    auto take = [&](auto &column, uint64_t size)
+    {
+      using T = typename remove_reference_t<decltype(column)>::value_type;
+      uint64_t bytes = size * sizeof(T);
+      if (size > length / sizeof(T) || position + bytes > length)
+      {
+        unmap();
+        throw runtime_error("cpptimer: truncated dump " + path);
+      }
+      column.data = reinterpret_cast<const T *>(file + position);
+      column.size = size;
+      position += (bytes + 7) / 8 * 8;
+    };
+
+    if (length < sizeof(DumpHeader))
+    {
+      unmap();
+      throw runtime_error("cpptimer: truncated dump " + path);
+    }
+    memcpy(&header, file, sizeof(DumpHeader));
+    if (memcmp(header.magic, "CPPTIMER", 8) != 0 ||
+        header.version != version || header.byte_order != byte_order)
+    {
+      unmap();
+      throw runtime_error("cpptimer: unsupported dump " + path);
+    }
+    if (header.tags >= UINT64_MAX / 8)
+    {
+      unmap();
+      throw runtime_error("cpptimer: corrupt string table in " + path);
+    }
+
+    Column<uint64_t> offset_column;
+    Column<char> char_column;
+    take(offset_column, header.tags + 1);
+    take(char_column, header.chars);
+    offsets = offset_column.data, chars = char_column.data;
+    take(stat_tag, header.stats);
+    take(mean, header.stats), take(sst, header.stats);
+    take(min, header.stats), take(max, header.stats);
+    take(count, header.stats);
+    take(sample_tag, header.samples), take(sample_thread, header.samples);
+    take(sample_duration, header.samples);
+    take(span_tag, header.spans), take(span_thread, header.spans);
+    take(span_start, header.spans), take(span_end, header.spans);
+    for (uint64_t i = 0; i < header.tags; i++)
+    {
+      if (offsets[i] > offsets[i + 1] || offsets[i + 1] > header.chars)
+      {
+        unmap();
+        throw runtime_error("cpptimer: corrupt string table in " + path);
+      }
+    }
+    for (const Column<uint32_t> *column : {&stat_tag, &sample_tag, &span_tag})
+    {
+      for (uint32_t id : *column)
+      {
+        if (id >= header.tags)
+        {
+          unmap();
+          throw runtime_error("cpptimer: tag out of range in " + path);
+        }
+      }
+    }
+  }
+
+  TimerDump(const TimerDump &) = delete;
+  TimerDump &operator=(const TimerDump &) = delete;
+  ~TimerDump() { unmap(); }
+
+  uint64_t tags() const { return header.tags; }
+  string_view tag(uint64_t id) const
+  {
+    return string_view(chars + offsets[id], offsets[id + 1] - offsets[id]);
+  }
+
+  // Statistics by tag, the same as aggregate() of the dumped timer
+  map<string, statistics> stats() const
+  {
+    map<string, statistics> result;
+    for (uint64_t i = 0; i < header.stats; i++)
+    {
+      result.emplace(string(tag(stat_tag[i])),
+                     statistics{mean[i], sst[i], min[i], max[i], count[i]});
+    }
+    return result;
+  }
+};
+
+// Open addressing hash table from strings to ids with linear probing. The
+// slots hold the hash and the index of the entry, so a probe touches one
+// cache line of slots and compares a single key in the common case. The
+// table is kept at most half full.
+class TagTable
+{
+private:
+  struct Slot
+  {
+    uint64_t hash;
+    unsigned int entry; // Index of the entry plus one, 0 if empty
+  };
+  vector<Slot> slots;
+  vector<string> keys;
+  vector<unsigned int> values;
+
+  void grow()
+  {
+    vector<Slot> old(max<size_t>(2 * slots.size(), 16), Slot{0, 0});
+    swap(slots, old);
+    const size_t mask = slots.size() - 1;
+    for (const Slot &slot : old)
+    {
+      if (slot.entry)
+      {
+        size_t i = slot.hash & mask;
+        while (slots[i].entry)
+        {
+          i = (i + 1) & mask;
+        }
+        slots[i] = slot;
+      }
+    }
+  }
+
+public:
+  // Multiplicative hash over 8 bytes at a time, tags are mostly short
+  static uint64_t hash(string_view key)
+  {
+    const uint64_t multiplier = 0xff51afd7ed558ccd;
+    uint64_t hash = 0x9e3779b97f4a7c15 ^ key.size(), word;
+    size_t i = 0;
+    for (; i + 8 <= key.size(); i += 8)
+    {
+      memcpy(&word, key.data() + i, 8);
+      hash = (hash ^ word) * multiplier;
+      hash ^= hash >> 32;
+    }
+    // The remaining bytes, read as the end of the last full word if any
+    if (size_t rest = key.size() - i; rest && key.size() >= 8)
+    {
+      memcpy(&word, key.data() + key.size() - 8, 8);
+      hash = (hash ^ (word >> (64 - 8 * rest))) * multiplier;
+    }
+    else if (rest)
+    {
+      word = 0;
+      for (size_t j = 0; j < rest; j++)
+      {
+        word |= uint64_t(uint8_t(key[i + j])) << (8 * j);
+      }
+      hash = (hash ^ word) * multiplier;
+    }
+    return hash ^ (hash >> 29);
+  }
+
+  size_t size() const { return keys.size(); }
+
+  // Value of key, nullptr if absent
+  const unsigned int *find(string_view key, uint64_t hash) const
+  {
+    if (slots.empty())
+    {
+      return nullptr;
+    }
+    const size_t mask = slots.size() - 1;
+    for (size_t i = hash & mask; slots[i].entry; i = (i + 1) & mask)
+    {
+      const Slot &slot = slots[i];
+      if (slot.hash == hash && keys[slot.entry - 1] == key)
+      {
+        return &values[slot.entry - 1];
+      }
+    }
+    return nullptr;
+  }
+  const unsigned int *find(string_view key) const
+  {
+    return find(key, hash(key));
+  }
+
+  // Insert key with value unless it is present. Returns the value of key
+  // and whether it was inserted.
+  pair<unsigned int, bool> try_emplace(string_view key, uint64_t hash,
+                                       unsigned int value)
+  {
+    if (const unsigned int *found = find(key, hash))
+    {
+      return {*found, false};
+    }
+    if (2 * (keys.size() + 1) > slots.size())
+    {
+      grow();
+    }
+    const size_t mask = slots.size() - 1;
+    size_t i = hash & mask;
+    while (slots[i].entry)
+    {
+      i = (i + 1) & mask;
+    }
+    keys.emplace_back(key);
+    values.push_back(value);
+    slots[i] = {hash, (unsigned int)keys.size()};
+    return {value, true};
+  }
+};
+
+// Parts of the timer that don't depend on the clock
+class CppTimerBase
+{
+protected:
+  // Tag registry: the string of each handle and the handle of each string.
+  // Guarded by a mutex, as tags are registered from threads of any kind. A
+  // function-local static, so that translation units that never register a
+  // tag, like those of the disabled timer, carry no code to construct it.
+  struct Registry
+  {
+    mutex lock;
+    vector<string> names;
+    TagTable ids;
+  };
+  static Registry &registry()
+  {
+    static Registry instance;
+    return instance;
+  }
+
+  // Welford state of a tag without any samples
+  static inline const statistics empty{0, 0, numeric_limits<double>::max(),
+                                       0, 0};
+
+  // Welford's online algorithm for mean and sst
+  // sst = sum of squared total deviations
+  // A weight > 1 counts the duration that many times (West's algorithm)
+  static void update(statistics &stats, double duration,
+                     unsigned long int weight = 1)
+  {
+    auto &[mean, sst, min, max, count] = stats;
+    count += weight;
+    double delta = duration - mean;
+    mean += delta * weight / count;
+    sst += weight * delta * (duration - mean);
+    min = std::min(min, duration);
+    max = std::max(max, duration);
+  }
+
+  // Summary of a set of samples: Welford states in clock ticks and
+  // histograms in nanoseconds by tag id. Partial summaries of threads or
+  // chunks of samples are reduced pairwise.
+  struct Partial
+  {
+    pmr::vector<statistics> stats;
+    pmr::vector<Histogram> histograms;
+    pmr::vector<unsigned long int> skipped; // Calls not timed due to sampling
+    pmr::vector<unsigned long int> rejected; // Samples discarded as outliers
+    // Per-iteration means of batches, weighted by iterations, and the number
+    // of batches
+    pmr::vector<statistics> batched;
+    pmr::vector<unsigned long int> batches;
+    pmr::set<unsigned int> needless_tocs;
+
+    Partial(pmr::memory_resource *resource = pmr::get_default_resource())
+        : stats(resource), histograms(resource), skipped(resource),
+          rejected(resource), batched(resource), batches(resource),
+          needless_tocs(resource)
+    {
+    }
+
+    void record(unsigned int id, double ticks)
+    {
+      if (id >= stats.size())
+      {
+        stats.resize(id + 1, empty);
+      }
+      update(stats[id], ticks);
+    }
+
+    void record_batch(unsigned int id, double ticks,
+                      unsigned long int iterations)
+    {
+      if (id >= batched.size())
+      {
+        batched.resize(id + 1, empty);
+        batches.resize(id + 1);
+      }
+      update(batched[id], ticks, iterations);
+      batches[id]++;
+    }
+
+    void record_histogram(unsigned int id, double ns)
+    {
+      if (id >= histograms.size())
+      {
+        histograms.resize(id + 1);
+      }
+      histograms[id].record(ns);
+    }
+
+    void reject(unsigned int id)
+    {
+      if (id >= rejected.size())
+      {
+        rejected.resize(id + 1);
+      }
+      rejected[id]++;
+    }
+
+    // Without histograms when they are merged by tag elsewhere
+    void merge(const Partial &other, bool with_histograms = true)
+    {
+      if (stats.size() < other.stats.size())
+      {
+        stats.resize(other.stats.size(), empty);
+      }
+      for (unsigned int id = 0; id < other.stats.size(); id++)
+      {
+        CppTimerBase::merge(stats[id], other.stats[id]);
+      }
+      if (with_histograms && histograms.size() < other.histograms.size())
+      {
+        histograms.resize(other.histograms.size());
+      }
+      for (unsigned int id = 0;
+           with_histograms && id < other.histograms.size(); id++)
+      {
+        histograms[id].merge(other.histograms[id]);
+      }
+      if (skipped.size() < other.skipped.size())
+      {
+        skipped.resize(other.skipped.size());
+      }
+      for (unsigned int id = 0; id < other.skipped.size(); id++)
+      {
+        skipped[id] += other.skipped[id];
+      }
+      if (rejected.size() < other.rejected.size())
+      {
+        rejected.resize(other.rejected.size());
+      }
+      for (unsigned int id = 0; id < other.rejected.size(); id++)
+      {
+        rejected[id] += other.rejected[id];
+      }
+      if (batched.size() < other.batched.size())
+      {
+        batched.resize(other.batched.size(), empty);
+        batches.resize(other.batches.size());
+      }
+      for (unsigned int id = 0; id < other.batched.size(); id++)
+      {
+        CppTimerBase::merge(batched[id], other.batched[id]);
+        batches[id] += other.batches[id];
+      }
+      needless_tocs.insert(begin(other.needless_tocs),
+                           end(other.needless_tocs));
+    }
+
+    // Histograms stay allocated, so recording into them again doesn't
+    // allocate
+    void clear()
+    {
+      stats.clear(), skipped.clear(), rejected.clear();
+      batched.clear(), batches.clear(), needless_tocs.clear();
+      for (Histogram &histogram : histograms)
+      {
+        histogram.clear();
+      }
+    }
+  };
+
+  // Regularized incomplete beta function I_x(a, b), by the continued
+  // fraction of Numerical Recipes (modified Lentz), which converges fast for
+  // x < (a + 1) / (a + b + 2) and is used through symmetry otherwise
+  static double incomplete_beta(double a, double b, double x)
+  {
+    if (!(x > 0))
+    {
+      return 0;
+    }
+    if (!(x < 1))
+    {
+      return 1;
+    }
+    if (x > (a + 1) / (a + b + 2))
+    {
+      return 1 - incomplete_beta(b, a, 1 - x);
+    }
+    const double tiny = 1e-300;
+    double front = exp(lgamma(a + b) - lgamma(a) - lgamma(b) +
+                       a * log(x) + b * log1p(-x)) /
+                   a;
+    double c = 1, d = 1 - (a + b) * x / (a + 1);
+    d = 1 / (fabs(d) < tiny ? tiny : d);
+    double result = d;
+    for (int m = 1; m <= 300; m++)
+    {
+      // Even and odd terms of the fraction
+      for (int odd = 0; odd < 2; odd++)
+      {
+        double numerator =
+            odd ? -(a + m) * (a + b + m) * x / ((a + 2 * m) * (a + 2 * m + 1))
+                : m * (b - m) * x / ((a + 2 * m - 1) * (a + 2 * m));
+        d = 1 + numerator * d;
+        d = 1 / (fabs(d) < tiny ? tiny : d);
+        c = 1 + numerator / c;
+        c = fabs(c) < tiny ? tiny : c;
+        result *= c * d;
+        if (odd && fabs(c * d - 1) < 1e-15)
+        {
+          return front * result;
+        }
+      }
+    }
+    return front * result;
+  }
+
+  // Probability that Student's t with degrees of freedom exceeds t
+  static double student_upper(double t, double degrees)
+  {
+    if (isinf(t))
+    {
+      return t > 0 ? 0 : 1;
+    }
+    double tail = incomplete_beta(degrees / 2, 0.5,
+                                  degrees / (degrees + t * t)) /
+                  2;
+    return t > 0 ? tail : 1 - tail;
+  }
+
+  // Which calls of a tag are timed: every n-th, or those where a random
+  // 64-bit number falls below threshold
+  struct SamplingRule
+  {
+    unsigned long int every;
+    uint64_t threshold;
+  };
+
+public:
+  // Chan et al.'s pairwise combination of two Welford states
+  static void merge(statistics &stats, const statistics &other)
+  {
+    auto &[mean, sst, min, max, count] = stats;
+    auto &[other_mean, other_sst, other_min, other_max, other_count] = other;
+    if (other_count == 0)
+    {
+      return;
+    }
+    double total = double(count) + other_count;
+    double delta = other_mean - mean;
+    mean += delta * other_count / total;
+    sst += other_sst + delta * delta * (double(count) * other_count / total);
+    min = std::min(min, other_min);
+    max = std::max(max, other_max);
+    count += other_count;
+  }
+
+  // Register a tag and return its handle. Each thread caches the handles
+  // it has seen, so repeated lookups don't take the lock.
+  static TagHandle handle(string_view tag)
+  {
+    static thread_local TagTable cache;
+
+    const uint64_t hash = TagTable::hash(tag);
+    if (const unsigned int *cached = cache.find(tag, hash))
+    {
+      return {*cached};
+    }
+
+    unsigned int id;
+    {
+      Registry &tags = registry();
+      lock_guard<mutex> lock(tags.lock);
+      bool inserted;
+      tie(id, inserted) = tags.ids.try_emplace(tag, hash, tags.names.size());
+      if (inserted)
+      {
+        tags.names.emplace_back(tag);
+      }
+    }
+    cache.try_emplace(tag, hash, id);
+    return {id};
+  }
+
+  // The tag a handle was registered with
+  static string name(TagHandle tag)
+  {
+    Registry &tags = registry();
+    lock_guard<mutex> lock(tags.lock);
+    return tags.names.at(tag.id);
+  }
+
+  // Statistics of each tag by thread, CPU and NUMA node in nanoseconds, as
+  // dense row-major matrices with a row per tag. Imbalance is the largest
+  // total time of a thread divided by the mean over all threads.
+  struct Breakdown
+  {
+    vector<string> tags;
+    unsigned int threads = 0, cpus = 0, nodes = 0;
+    vector<statistics> by_thread, by_cpu, by_node;
+    vector<double> imbalance; // By tag
+
+    const statistics &thread(size_t tag, unsigned int thread) const
+    {
+      return by_thread[tag * threads + thread];
+    }
+    const statistics &cpu(size_t tag, unsigned int cpu) const
+    {
+      return by_cpu[tag * cpus + cpu];
+    }
+    const statistics &node(size_t tag, unsigned int node) const
+    {
+      return by_node[tag * nodes + node];
+    }
+  };
+
+  // Slowdown of a tag against a baseline, see BasicCppTimer::regressions()
+  struct Regression
+  {
+    string tag;
+    double baseline, current; // Means in nanoseconds
+    double change;            // current / baseline - 1
+    double t, degrees;        // Welch's t statistic and degrees of freedom
+    double p; // One-sided p-value of current being no slower than baseline
+  };
+
+  // Number of CPUs that sched_getcpu() can return, 0 where it isn't
+  // available
+  static unsigned int cpu_count()
+  {
+#ifdef __linux__
+    static const unsigned int count = std::max(sysconf(_SC_NPROCESSORS_CONF),
+                                               1l);
+    return count;
+#else
+    return 0;
+#endif
+  }
+
+  // NUMA node of each CPU, from sysfs. 0 if unknown.
+  static vector<unsigned int> cpu_nodes()
+  {
+    vector<unsigned int> nodes(cpu_count(), 0);
+#ifdef __linux__
+    for (unsigned int cpu = 0; cpu < nodes.size(); cpu++)
+    {
+      string path = "/sys/devices/system/cpu/cpu" + to_string(cpu);
+      DIR *directory = opendir(path.c_str());
+      if (!directory)
+      {
+        continue;
+      }
+      while (dirent *entry = readdir(directory))
+      {
+        unsigned int node;
+        if (sscanf(entry->d_name, "node%u", &node) == 1)
+        {
+          nodes[cpu] = node;
+        }
+      }
+      closedir(directory);
+    }
+#endif
+    return nodes;
+  }
+};
+
+// Clock can be any clock of <chrono>, coarse_clock or tsc_clock.
+// BasicCppTimer<Clock, false> is a stub with the same interface that does
+// nothing.
+template <class Clock = high_resolution_clock,
+          bool Enabled = cpptimer_enabled>
+class BasicCppTimer : public CppTimerBase
+{
+protected:
+  using time_point = typename Clock::time_point;
+
+  set<string> missing_tics, needless_tocs; // Set of missing tics
+  // Data to be returned: Tag, Mean, SD, Min, Max, Count
+  map<string, statistics> data;
+  map<string, Histogram> histograms; // Filled if quantiles is set
+  // Call tree by path of tags separated by "/", filled if hierarchical is set
+  map<string, tree_statistics> paths;
+  // Filled if hardware_counters is set
+  map<string, counter_statistics> counter_data;
+  // Filled if track_allocations is set
+  map<string, allocation_statistics> allocation_data;
+  // Samples discarded by the rejection rule, see reject_mads
+  map<string, unsigned long int> rejections;
+  // Iterations timed in batches and the number of batches by tag. Their
+  // samples carry the overhead of one clock pair per batch.
+  map<string, pair<unsigned long int, unsigned long int>> batch_counts;
+  // Range of the kept samples by tag id in clock ticks, as of the last
+  // aggregate()
+  vector<pair<double, double>> limits;
+  // Statistics of an earlier run to compare to, see regressions()
+  map<string, statistics> reference;
+
+  // Call tree of one thread as a contiguous array of nodes. Node 0 is the
+  // root, children are linked through child and sibling (0 means none).
+  // The stack holds the open nodes and their start times.
+  struct CallTree
+  {
+    struct Node
+    {
+      unsigned int tag, parent, child, sibling;
+      unsigned long int count;
+      double inclusive, children; // Clock ticks
+    };
+    vector<Node> nodes;
+    vector<pair<unsigned int, time_point>> stack;
+
+    // Open the child of the current node for tag, returns its start time
+    time_point &enter(unsigned int tag)
+    {
+      if (nodes.empty())
+      {
+        nodes.push_back({0, 0, 0, 0, 0, 0, 0});
+      }
+      unsigned int parent = stack.empty() ? 0 : stack.back().first;
+      unsigned int node = nodes[parent].child;
+      while (node && nodes[node].tag != tag)
+      {
+        node = nodes[node].sibling;
+      }
+      if (!node)
+      {
+        node = nodes.size();
+        nodes.push_back({tag, parent, 0, nodes[parent].child, 0, 0, 0});
+        nodes[parent].child = node;
+      }
+      stack.emplace_back(node, time_point());
+      return stack.back().second;
+    }
+
+    // Close the innermost open node for tag and the ones opened after it
+    void leave(unsigned int tag, time_point now)
+    {
+      for (unsigned long int i = stack.size(); i-- > 0;)
+      {
+        Node &node = nodes[stack[i].first];
+        if (node.tag == tag)
+        {
+          double duration = (now - stack[i].second).count();
+          node.count++;
+          node.inclusive += duration;
+          nodes[node.parent].children += duration;
+          stack.resize(i);
+          return;
+        }
+      }
+    }
+  };
+
+  // Statistics of the calls that ended in one period, see windows()
+  struct Window
+  {
+    int64_t epoch = -1; // Number of the period since the clock's epoch
+    Partial partial;
+  };
+
+  // Memory of a thread buffer: a pool over the upstream resource of the
+  // timer, so that the containers of the buffer reuse their blocks
+  struct Arena
+  {
+    unique_ptr<pmr::unsynchronized_pool_resource> pool;
+
+    Arena(pmr::memory_resource *upstream)
+        : pool(make_unique<pmr::unsynchronized_pool_resource>(upstream))
+    {
+    }
+  };
+
+  // Per-thread storage. Start times are indexed by tag id, min() marks a tag
+  // that was never started and max() a tag that was already stopped.
+  // The Partial holds the statistics in streaming mode.
+  // Padded to a cache line to avoid false sharing between threads.
+  struct alignas(64) ThreadBuffer : Arena, Partial
+  {
+    pmr::vector<time_point> tics;
+    pmr::vector<unsigned int> ids; // Tag id of each sample
+    pmr::vector<double> durations;
+    pmr::set<unsigned int> missing_tics;
+    RingBuffer<Sample> samples; // Sample log
+    RingBuffer<Span> spans;     // Trace
+    CallTree tree;
+    SpscQueue<Sample> queue;         // To the background aggregator
+    vector<unsigned long int> calls; // Calls by tag id, for sampling
+    uint64_t random = 0x9e3779b97f4a7c15; // xorshift64 state
+    vector<Window> windows; // Ring of the last periods
+    // Counters at the last tic, and their total deltas and calls by tag id
+    vector<counter_values> counter_tics, counter_totals;
+    vector<unsigned long int> counter_calls;
+    // Counters and the saved peak at the last tic by tag id, and the sums
+    vector<AllocationCounters> allocation_tics, allocation_totals;
+    vector<unsigned long int> allocation_calls;
+    // Clock ticks by tag id, and by tag id and CPU, see placement
+    vector<statistics> thread_stats, cpu_stats;
+
+    ThreadBuffer(pmr::memory_resource *upstream = pmr::get_default_resource())
+        : Arena(upstream), Partial(this->pool.get()),
+          tics(this->pool.get()), ids(this->pool.get()),
+          durations(this->pool.get()), missing_tics(this->pool.get())
+    {
+    }
+  };
+  vector<ThreadBuffer> buffers;          // Lock-free, one per thread
+  // OS thread that owns each buffer, empty until claimed
+  unique_ptr<atomic<thread::id>[]> claims;
+  // All other threads by thread number and OS thread, guarded by
+  // shared_lock. A mutex rather than an OpenMP critical section, since
+  // tokens may be finished on threads of any kind, with or without OpenMP.
+  map<pair<unsigned int, thread::id>, ThreadBuffer> shared;
+  mutex shared_lock;
+
+  // Whether the calling thread may use buffer thread without a lock. Thread
+  // numbers repeat in nested regions, in teams started by different threads
+  // and in threads not started by OpenMP, so the first OS thread that uses
+  // a buffer claims it and every other thread takes the locked storage.
+  bool owns(unsigned int thread) const
+  {
+    if (thread >= buffers.size())
+    {
+      return false;
+    }
+    const thread::id self = this_thread::get_id();
+    thread::id claimed = claims[thread].load(memory_order_relaxed);
+    return claimed == self ||
+           (claimed == thread::id() &&
+            claims[thread].compare_exchange_strong(claimed, self,
+                                                   memory_order_relaxed));
+  }
+
+  // Memory of new thread buffers, and the room reserved in them
+  pmr::memory_resource *upstream = pmr::get_default_resource();
+  unsigned long int reserved_samples = 0;
+  unsigned int reserved_tags = 0;
+
+  void prepare(ThreadBuffer &buffer)
+  {
+    buffer.tics.reserve(reserved_tags), buffer.stats.reserve(reserved_tags);
+    buffer.ids.reserve(reserved_samples);
+    buffer.durations.reserve(reserved_samples);
+  }
+
+  // Buffer of a thread without its own one, must be called with shared_lock
+  // held
+  ThreadBuffer &locked(unsigned int thread)
+  {
+    auto [entry, inserted] =
+        shared.try_emplace({thread, this_thread::get_id()}, upstream);
+    if (inserted)
+    {
+      prepare(entry->second);
+    }
+    return entry->second;
+  }
+
+  // Sampling rules by tag id, empty if no tag is sampled
+  vector<SamplingRule> sampling;
+  // Skipped calls by tag id of tags that had no timed call yet
+  vector<unsigned long int> pending_skipped;
+
+  // Skipped calls of a tag without a timed call since the last aggregate()
+  // are added to its statistics if it has some, scaled like in fold(), and
+  // otherwise kept for the next aggregate(), so counts cover all calls
+  void carry(Partial &summary)
+  {
+    if (summary.skipped.size() < pending_skipped.size())
+    {
+      summary.skipped.resize(pending_skipped.size());
+    }
+    pending_skipped.resize(summary.skipped.size());
+    for (unsigned int id = 0; id < summary.skipped.size(); id++)
+    {
+      unsigned long int &skipped = summary.skipped[id];
+      skipped += pending_skipped[id];
+      pending_skipped[id] = 0;
+      if (!skipped ||
+          (id < summary.stats.size() && get<4>(summary.stats[id]) > 0))
+      {
+        continue;
+      }
+      auto entry{data.find(name({id}))};
+      if (entry == end(data))
+      {
+        pending_skipped[id] = skipped;
+      }
+      else
+      {
+        auto &[mean, sst, min, max, count] = entry->second;
+        if (count > 1)
+        {
+          sst *= double(count + skipped - 1) / (count - 1);
+        }
+        count += skipped;
+      }
+      skipped = 0;
+    }
+  }
+
+  // Start time of a call that is not timed
+  static time_point unsampled()
+  {
+    return time_point::min() + typename Clock::duration(1);
+  }
+
+  bool sampled(ThreadBuffer &buffer, unsigned int id)
+  {
+    const SamplingRule &rule = sampling[id];
+    if (rule.every > 1)
+    {
+      if (id >= buffer.calls.size())
+      {
+        buffer.calls.resize(id + 1);
+      }
+      return buffer.calls[id]++ % rule.every == 0;
+    }
+    uint64_t &x = buffer.random;
+    x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+    return x <= rule.threshold;
+  }
+
+  // Count a toc whose tic was not sampled, without reading the clock
+  static bool skip(ThreadBuffer &buffer, unsigned int id)
+  {
+    if (id >= buffer.tics.size() || buffer.tics[id] != unsampled())
+    {
+      return false;
+    }
+    buffer.tics[id] = time_point::max();
+    if (id >= buffer.skipped.size())
+    {
+      buffer.skipped.resize(id + 1);
+    }
+    buffer.skipped[id]++;
+    return true;
+  }
+
+  void start(ThreadBuffer &buffer, unsigned int id)
+  {
+    if (id >= buffer.tics.size())
+    {
+      buffer.tics.resize(id + 1, time_point::min());
+    }
+    if (id < sampling.size() && !sampled(buffer, id))
+    {
+      buffer.tics[id] = unsampled();
+      return;
+    }
+    // The counters and the allocations are read before the clock, so the
+    // duration doesn't include reading them
+    time_point *opened = hierarchical ? &buffer.tree.enter(id) : nullptr;
+    if (hardware_counters)
+    {
+      if (id >= buffer.counter_tics.size())
+      {
+        buffer.counter_tics.resize(id + 1);
+      }
+      PerfCounters::local().read(buffer.counter_tics[id]);
+    }
+    if (track_allocations)
+    {
+      if (id >= buffer.allocation_tics.size())
+      {
+        buffer.allocation_tics.resize(id + 1);
+      }
+      // Restart the peak so that it covers this call, the previous one is
+      // restored at toc
+      AllocationCounters &counters = cpptimer_allocations;
+      buffer.allocation_tics[id] = counters;
+      counters.peak = counters.live;
+    }
+    buffer.tics[id] = Clock::now();
+    if (opened)
+    {
+      *opened = buffer.tics[id];
+    }
+  }
+
+  // Capacity and overflow policy of the sample logs, 0 if disabled
+  unsigned long int log_capacity = 0;
+  Overflow log_overflow = Overflow::overwrite_oldest;
+  // Same for the traces
+  unsigned long int trace_capacity = 0;
+  Overflow trace_overflow = Overflow::drop_newest;
+  // Length and number of the windows, 0 if disabled
+  typename Clock::duration window_length{1};
+  unsigned int window_count = 0;
+
+  void record_window(ThreadBuffer &buffer, unsigned int id, time_point now,
+                     double ticks)
+  {
+    int64_t epoch = now.time_since_epoch() / window_length;
+    if (buffer.windows.size() != window_count)
+    {
+      buffer.windows.assign(window_count, Window());
+    }
+    Window &window = buffer.windows[uint64_t(epoch) % window_count];
+    if (window.epoch != epoch)
+    {
+      window.partial.clear();
+      window.epoch = epoch;
+    }
+    window.partial.record(id, ticks);
+    if (quantiles)
+    {
+      const double scale = clock_scale<Clock>::ns_per_tick();
+      window.partial.record_histogram(id, ticks * scale);
+    }
+  }
+
+  // Summary of the current and the count - 1 previous windows of all threads
+  Partial recent(unsigned int count) const
+  {
+    Partial summary;
+    if (!window_count)
+    {
+      return summary;
+    }
+    int64_t epoch = Clock::now().time_since_epoch() / window_length;
+    auto add = [&](const ThreadBuffer &buffer)
+    {
+      for (const Window &window : buffer.windows)
+      {
+        if (window.epoch <= epoch && window.epoch > epoch - int64_t(count))
+        {
+          summary.merge(window.partial);
+        }
+      }
+    };
+    for (const ThreadBuffer &buffer : buffers)
+    {
+      add(buffer);
+    }
+    for (const auto &[thread, buffer] : shared)
+    {
+      add(buffer);
+    }
+    return summary;
+  }
+
+  // Consumer thread that folds the queues of the buffers into data
+  struct Background
+  {
+    thread worker;
+    mutex lock; // Guards data while the worker runs
+    condition_variable wake;
+    bool stop = false;
+    milliseconds interval;
+    vector<statistics *> entries; // Entries of data by tag id
+  };
+  unique_ptr<Background> background;
+
+  // Copy of data for snapshot(), updated by every writer of data
+  PublishedStatistics published;
+  vector<statistics> publishing; // By tag id, reused
+
+  // Must be called with the guard held
+  void publish()
+  {
+    publishing.clear();
+    for (const auto &[tag, stats] : data)
+    {
+      unsigned int id = handle(tag).id;
+      if (id >= publishing.size())
+      {
+        publishing.resize(id + 1, empty);
+      }
+      publishing[id] = stats;
+    }
+    published.publish(publishing);
+  }
+
+  unique_lock<mutex> guard() const
+  {
+    return background ? unique_lock<mutex>(background->lock)
+                      : unique_lock<mutex>();
+  }
+
+  void consume()
+  {
+    const double scale = clock_scale<Clock>::ns_per_tick();
+    Background &state = *background;
+    unique_lock<mutex> lock(state.lock);
+    bool stopping = false;
+    while (!stopping)
+    {
+      stopping = state.wake.wait_for(lock, state.interval,
+                                     [&]() { return state.stop; });
+      for (ThreadBuffer &buffer : buffers)
+      {
+        buffer.queue.drain(
+            [&](const Sample &sample)
+            {
+              if (sample.tag >= state.entries.size())
+              {
+                state.entries.resize(sample.tag + 1, nullptr);
+              }
+              statistics *&entry = state.entries[sample.tag];
+              if (!entry)
+              {
+                entry = &data.try_emplace(name({sample.tag}), empty)
+                             .first->second;
+              }
+              update(*entry, sample.duration * scale);
+            });
+      }
+      publish();
+    }
+  }
+
+  // Add a summary in clock ticks to statistics and histograms by tag name,
+  // in nanoseconds
+  static void fold(const Partial &summary, map<string, statistics> &data,
+                   map<string, Histogram> &histograms)
+  {
+    const double scale = clock_scale<Clock>::ns_per_tick();
+    for (unsigned int id = 0; id < summary.stats.size(); id++)
+    {
+      auto [mean, sst, min, max, count] = summary.stats[id];
+      if (count > 0)
+      {
+        // Extrapolate from the sampled calls to all calls
+        unsigned long int calls = count;
+        if (id < summary.skipped.size())
+        {
+          calls += summary.skipped[id];
+        }
+        if (count > 1)
+        {
+          sst *= double(calls - 1) / (count - 1);
+        }
+        merge(data.try_emplace(name({id}), empty).first->second,
+              {mean * scale, sst * scale * scale, min * scale, max * scale,
+               calls});
+      }
+    }
+    // Batches of equal size n have means with variance sigma^2 / n, so the
+    // sst of the iterations is estimated from the weighted sst of the
+    // batch means as sst * (iterations - 1) / (batches - 1)
+    for (unsigned int id = 0; id < summary.batched.size(); id++)
+    {
+      auto [mean, sst, min, max, iterations] = summary.batched[id];
+      unsigned long int batches = summary.batches[id];
+      if (batches == 0)
+      {
+        continue;
+      }
+      sst = batches > 1 ? sst * (iterations - 1) / (batches - 1) : 0;
+      merge(data.try_emplace(name({id}), empty).first->second,
+            {mean * scale, sst * scale * scale, min * scale, max * scale,
+             iterations});
+    }
+    // Ids are global, so most below the size belong to other timers
+    for (unsigned int id = 0; id < summary.histograms.size(); id++)
+    {
+      if (summary.histograms[id].count() > 0)
+      {
+        histograms[name({id})].merge(summary.histograms[id]);
+      }
+    }
+  }
+
+  // Tree reduction of partial summaries into the first one
+  static void reduce(vector<Partial> &partials)
+  {
+    for (unsigned long int stride = 1; stride < partials.size(); stride *= 2)
+    {
+#pragma omp parallel for
+      for (long int i = 0; i < long(partials.size()); i += 2 * stride)
+      {
+        if (i + stride < partials.size())
+        {
+          partials[i].merge(partials[i + stride]);
+        }
+      }
+    }
+  }
+
+  void stop(ThreadBuffer &buffer, unsigned int id, unsigned int thread,
+            time_point now)
+  {
+    counter_values counted;
+    bool counting =
+        hardware_counters && PerfCounters::local().read(counted);
+    AllocationCounters allocated = cpptimer_allocations;
+    if (track_allocations && id < buffer.allocation_tics.size())
+    {
+      AllocationCounters &counters = cpptimer_allocations;
+      counters.peak = std::max(counters.peak,
+                               buffer.allocation_tics[id].peak);
+    }
+    if (hierarchical)
+    {
+      buffer.tree.leave(id, now);
+    }
+    if (id >= buffer.tics.size() || buffer.tics[id] == time_point::min())
+    {
+      buffer.missing_tics.insert(id);
+      return;
+    }
+    typename Clock::duration duration = now - buffer.tics[id];
+    buffer.tics[id] = time_point::max();
+    if (counting && duration.count() >= 0 && id < buffer.counter_tics.size())
+    {
+      if (id >= buffer.counter_totals.size())
+      {
+        buffer.counter_totals.resize(id + 1);
+        buffer.counter_calls.resize(id + 1);
+      }
+      for (unsigned int i = 0; i < counted.size(); i++)
+      {
+        buffer.counter_totals[id][i] += counted[i] - buffer.counter_tics[id][i];
+      }
+      buffer.counter_calls[id]++;
+    }
+    if (track_allocations && duration.count() >= 0 &&
+        id < buffer.allocation_tics.size())
+    {
+      if (id >= buffer.allocation_totals.size())
+      {
+        buffer.allocation_totals.resize(id + 1, {0, 0, 0, 0});
+        buffer.allocation_calls.resize(id + 1);
+      }
+      const AllocationCounters &start = buffer.allocation_tics[id];
+      AllocationCounters &total = buffer.allocation_totals[id];
+      total.bytes += allocated.bytes - start.bytes;
+      total.count += allocated.count - start.count;
+      total.peak = std::max(total.peak, allocated.peak - start.live);
+      buffer.allocation_calls[id]++;
+    }
+    store(buffer, id, thread, duration, now);
+  }
+
+  bool rejecting() const
+  {
+    return reject_mads > 0 || reject_above < numeric_limits<double>::max();
+  }
+
+  // Set the range of the MAD rule of tag id from the median and MAD of
+  // histogram in nanoseconds
+  void limit(unsigned int id, const Histogram &histogram)
+  {
+    const double scale = clock_scale<Clock>::ns_per_tick();
+    if (id >= limits.size())
+    {
+      limits.resize(id + 1, {0, numeric_limits<double>::max()});
+    }
+    double median = histogram.quantile(0.5);
+    double mad = histogram.mad(median);
+    if (mad > 0)
+    {
+      limits[id] = {(median - reject_mads * mad) / scale,
+                    (median + reject_mads * mad) / scale};
+    }
+  }
+
+  // Whether the rule keeps a sample of ticks
+  bool kept(unsigned int id, double ticks) const
+  {
+    bool kept = ticks * clock_scale<Clock>::ns_per_tick() <= reject_above;
+    if (reject_mads > 0 && id < limits.size())
+    {
+      kept &= ticks >= limits[id].first && ticks <= limits[id].second;
+    }
+    return kept;
+  }
+
+  // Count a sample of ticks as rejected if the rule leaves it out
+  bool rejects(Partial &partial, unsigned int id, double ticks) const
+  {
+    if (!rejecting() || kept(id, ticks))
+    {
+      return false;
+    }
+    partial.reject(id);
+    return true;
+  }
+
+  void place(ThreadBuffer &buffer, unsigned int id, double ticks)
+  {
+    if (id >= buffer.thread_stats.size())
+    {
+      buffer.thread_stats.resize(id + 1, empty);
+    }
+    update(buffer.thread_stats[id], ticks);
+#ifdef __linux__
+    const unsigned int cpus = cpu_count();
+    int cpu = sched_getcpu();
+    if (cpu < 0 || unsigned(cpu) >= cpus)
+    {
+      return;
+    }
+    if ((id + 1ul) * cpus > buffer.cpu_stats.size())
+    {
+      buffer.cpu_stats.resize((id + 1ul) * cpus, empty);
+    }
+    update(buffer.cpu_stats[id * cpus + cpu], ticks);
+#endif
+  }
+
+  // Record a call of tag id that ended at now
+  void store(ThreadBuffer &buffer, unsigned int id, unsigned int thread,
+             typename Clock::duration duration, time_point now)
+  {
+    if (log_capacity && duration.count() >= 0)
+    {
+      if (buffer.samples.capacity() != log_capacity)
+      {
+        buffer.samples.allocate(log_capacity, log_overflow);
+      }
+      buffer.samples.push({id, thread, uint64_t(duration.count())});
+    }
+    if (trace_capacity && duration.count() >= 0)
+    {
+      if (buffer.spans.capacity() != trace_capacity)
+      {
+        buffer.spans.allocate(trace_capacity, trace_overflow);
+      }
+      buffer.spans.push({id, thread,
+                         int64_t(now.time_since_epoch().count() -
+                                 duration.count()),
+                         int64_t(now.time_since_epoch().count())});
+    }
+    if (window_count && duration.count() >= 0)
+    {
+      record_window(buffer, id, now, duration.count());
+    }
+    if (placement && duration.count() >= 0)
+    {
+      place(buffer, id, duration.count());
+    }
+    if ((streaming || buffer.queue.active()) && duration.count() >= 0 &&
+        rejects(buffer, id, duration.count()))
+    {
+      return;
+    }
+    if (buffer.queue.active() && duration.count() >= 0 &&
+        buffer.queue.push({id, thread, uint64_t(duration.count())}))
+    {
+      return;
+    }
+    // Samples that overflow a full queue are summarised here
+    if (!streaming && !buffer.queue.active())
+    {
+      buffer.durations.push_back(duration.count());
+      buffer.ids.push_back(id);
+    }
+    else if (duration.count() < 0)
+    {
+      buffer.needless_tocs.insert(id);
+    }
+    else
+    {
+      buffer.record(id, duration.count());
+      if (quantiles)
+      {
+        buffer.record_histogram(id, duration.count() *
+                                        clock_scale<Clock>::ns_per_tick());
+      }
+    }
+  }
+
+public:
+  vector<string> tags;      // Vector of identifiers
+  vector<double> durations; // Vector of durations
+  bool verbose = true;      // Print warnings about not stopped timers
+  // Update the statistics in toc instead of storing every sample. Memory
+  // then grows with the number of tags, not with the number of calls.
+  bool streaming = false;
+  // Keep a histogram per tag to estimate quantiles with bounded memory
+  bool quantiles = false;
+  // Cost of an empty tic/toc pair in nanoseconds, measured by calibrate()
+  double overhead = 0;
+  // Subtract the overhead from mean, min and max returned by aggregate()
+  // and benchmark(), in batches divided by the iterations of a batch
+  bool subtract_overhead = false;
+  // Also record nested tic/toc pairs as a call tree, see tree()
+  bool hierarchical = false;
+  // Also read the hardware counters of the thread at tic and toc, see
+  // counters(). Linux only, costs a system call each.
+  bool hardware_counters = false;
+  // Also break each tag down by thread, CPU and NUMA node, see breakdown().
+  // Costs a sched_getcpu() per toc.
+  bool placement = false;
+  // Leave samples farther than reject_mads median absolute deviations from
+  // the median, or longer than reject_above nanoseconds, out of the
+  // statistics and count them per tag, see robust(). 0 and max() reject
+  // nothing. aggregate() estimates the median and MAD from the new samples
+  // and the histogram of the tag if quantiles is set. In streaming mode,
+  // where the samples are gone by then, toc() compares to the limits of the
+  // previous aggregate() instead, so the MAD rule needs quantiles there.
+  double reject_mads = 0;
+  double reject_above = numeric_limits<double>::max();
+  // Also count the heap allocations of each call, see allocations(). Needs
+  // CPPTIMER_TRACK_ALLOCATIONS in one translation unit. Includes what the
+  // timer itself allocates for nested calls.
+  bool track_allocations = false;
+
+  // This ensures that there are no implicit conversions in the constructors
+  // That means, the types must exactly match the constructor signature
+  template <typename T>
+  BasicCppTimer(T &&) = delete;
+
+  BasicCppTimer() {}
+  BasicCppTimer(bool verbose) : verbose(verbose) {}
+
+  ~BasicCppTimer() { stop_background(); }
+
+  // Give threads 0, ..., threads - 1 their own buffer so that tic and toc
+  // don't enter the critical section. Each buffer belongs to the first OS
+  // thread that uses it, buffer 0 to the caller. Threads with a higher
+  // number or whose buffer belongs to another thread fall back to the
+  // shared storage. Must be called outside of parallel regions.
+  void lockfree(int threads = omp_get_max_threads())
+  {
+    stop_background();
+    buffers.clear();
+    buffers.reserve(threads > 0 ? threads : 0);
+    claims = make_unique<atomic<thread::id>[]>(buffers.capacity() + 1);
+    for (int thread = 0; thread < threads; thread++)
+    {
+      prepare(buffers.emplace_back(upstream));
+      claims[thread].store(thread::id(), memory_order_relaxed);
+    }
+    claims[0].store(this_thread::get_id(), memory_order_relaxed);
+  }
+
+  // Take the memory of the per-thread bookkeeping from resource instead of
+  // the global heap, e.g. from a pmr::monotonic_buffer_resource over a
+  // preallocated block. Each thread buffer keeps a pool over resource, so
+  // blocks released by the timer are reused. Applies to buffers created
+  // afterwards, so call it before lockfree(). resource must outlive the
+  // timer.
+  void memory(pmr::memory_resource *resource) { upstream = resource; }
+
+  // Preallocate room for samples samples (without streaming) and tags tags
+  // in each thread buffer, so that tic and toc don't allocate until either
+  // is exceeded. Must be called outside of parallel regions.
+  void reserve(unsigned long int samples, unsigned int tags = 0)
+  {
+    reserved_samples = samples, reserved_tags = tags;
+    for (ThreadBuffer &buffer : buffers)
+    {
+      prepare(buffer);
+    }
+    for (auto &[thread, buffer] : shared)
+    {
+      prepare(buffer);
+    }
+  }
+
+  // Additionally keep the last (or first) capacity samples of each thread
+  // in a preallocated ring buffer, independent of aggregate(). A capacity
+  // of 0 disables the log. Must be called outside of parallel regions.
+  void capture(unsigned long int capacity,
+               Overflow overflow = Overflow::overwrite_oldest)
+  {
+    log_capacity = capacity, log_overflow = overflow;
+    for (ThreadBuffer &buffer : buffers)
+    {
+      buffer.samples.allocate(capacity, overflow);
+    }
+  }
+
+  // Logged samples of all threads with durations in nanoseconds
+  vector<Sample> samples() const
+  {
+    const double scale = clock_scale<Clock>::ns_per_tick();
+    vector<Sample> result;
+    auto append = [&](const ThreadBuffer &buffer)
+    {
+      buffer.samples.for_each(
+          [&](Sample sample)
+          {
+            sample.duration = llround(sample.duration * scale);
+            result.push_back(sample);
+          });
+    };
+    for (const ThreadBuffer &buffer : buffers)
+    {
+      append(buffer);
+    }
+    for (const auto &[thread, buffer] : shared)
+    {
+      append(buffer);
+    }
+    return result;
+  }
+
+  // Number of samples the logs overwrote or dropped
+  unsigned long int samples_lost() const
+  {
+    unsigned long int lost = 0;
+    for (const ThreadBuffer &buffer : buffers)
+    {
+      lost += buffer.samples.lost();
+    }
+    for (const auto &[thread, buffer] : shared)
+    {
+      lost += buffer.samples.lost();
+    }
+    return lost;
+  }
+
+  // Record the start and end of each tic/toc pair in a preallocated ring
+  // buffer per thread, for write_trace(). A capacity of 0 disables tracing.
+  // Must be called outside of parallel regions.
+  void trace(unsigned long int capacity,
+             Overflow overflow = Overflow::drop_newest)
+  {
+    trace_capacity = capacity, trace_overflow = overflow;
+    for (ThreadBuffer &buffer : buffers)
+    {
+      buffer.spans.allocate(capacity, overflow);
+    }
+  }
+
+  // Write the trace in the Chrome Trace Event format, which chrome://tracing
+  // and the Perfetto UI can open. Events are formatted into a small buffer
+  // that is flushed to out whenever it fills up.
+  void write_trace(ostream &out) const
+  {
+    const double scale = clock_scale<Clock>::ns_per_tick();
+
+    vector<const RingBuffer<Span> *> sources;
+    for (const ThreadBuffer &buffer : buffers)
+    {
+      sources.push_back(&buffer.spans);
+    }
+    for (const auto &[thread, buffer] : shared)
+    {
+      sources.push_back(&buffer.spans);
+    }
+
+    // Timestamps are relative to the first span
+    int64_t origin = numeric_limits<int64_t>::max();
+    unsigned int last_tag = 0;
+    for (const RingBuffer<Span> *spans : sources)
+    {
+      spans->for_each(
+          [&](const Span &span)
+          {
+            origin = std::min(origin, span.start);
+            last_tag = std::max(last_tag, span.tag);
+          });
+    }
+
+    // JSON-escaped tag names, looked up once
+    vector<string> escaped;
+    if (origin != numeric_limits<int64_t>::max())
+    {
+      for (unsigned int id = 0; id <= last_tag; id++)
+      {
+        string &tag = escaped.emplace_back();
+        for (char c : name({id}))
+        {
+          if (c == '"' || c == '\\')
+          {
+            tag += '\\', tag += c;
+          }
+          else if (static_cast<unsigned char>(c) < 0x20)
+          {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            tag += code;
+          }
+          else
+          {
+            tag += c;
+          }
+        }
+      }
+    }
+
+    char chunk[1 << 16];
+    unsigned long int used = 0;
+    const char *separator = "";
+    auto append = [&](const char *text, unsigned long int length)
+    {
+      if (used + length > sizeof(chunk))
+      {
+        out.write(chunk, used), used = 0;
+      }
+      if (length > sizeof(chunk))
+      {
+        out.write(text, length);
+        return;
+      }
+      copy(text, text + length, chunk + used), used += length;
+    };
+
+    const char *header = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    append(header, char_traits<char>::length(header));
+    for (const RingBuffer<Span> *spans : sources)
+    {
+      spans->for_each(
+          [&](const Span &span)
+          {
+            const string &tag = escaped[span.tag];
+            char event[256];
+            int length = snprintf(
+                event, sizeof(event),
+                "%s\n{\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,"
+                "\"dur\":%.3f,\"name\":\"",
+                separator, span.thread, (span.start - origin) * scale / 1000,
+                (span.end - span.start) * scale / 1000);
+            append(event, length);
+            append(tag.data(), tag.size());
+            append("\"}", 2);
+            separator = ",";
+          });
+    }
+    append("\n]}\n", 4);
+    out.write(chunk, used);
+  }
+
+  // Time only every n-th call of tag on each thread. The other calls skip
+  // both clock reads but still count, aggregate() scales the statistics to
+  // all calls. A tag appears once one of its calls was timed, with the
+  // calls skipped before. Must be called outside of parallel regions.
+  void sample_every(TagHandle tag, unsigned long int n)
+  {
+    if (tag.id >= sampling.size())
+    {
+      sampling.resize(tag.id + 1, {1, numeric_limits<uint64_t>::max()});
+    }
+    sampling[tag.id] = {std::max(n, 1ul), numeric_limits<uint64_t>::max()};
+  }
+
+  // Time a random fraction rate of the calls of tag, see sample_every()
+  void sample_rate(TagHandle tag, double rate)
+  {
+    if (tag.id >= sampling.size())
+    {
+      sampling.resize(tag.id + 1, {1, numeric_limits<uint64_t>::max()});
+    }
+    sampling[tag.id] = {1, rate >= 1 ? numeric_limits<uint64_t>::max()
+                                      : uint64_t(std::max(rate, 0.0) * 0x1p64)};
+  }
+
+  void sample_every(const string &tag, unsigned long int n)
+  {
+    sample_every(handle(tag), n);
+  }
+  void sample_rate(const string &tag, double rate)
+  {
+    sample_rate(handle(tag), rate);
+  }
+
+  // Run function iterations times between a single pair of clock reads and
+  // record the time per iteration, for code too fast to time one call at
+  // a time. Min and max are those of the batch means. Returns the time per
+  // iteration in nanoseconds.
+  template <class Function>
+  double time_batch(TagHandle tag, unsigned long int iterations,
+                    Function &&function)
+  {
+    if (iterations == 0)
+    {
+      return 0;
+    }
+    time_point start = Clock::now();
+    for (unsigned long int i = 0; i < iterations; i++)
+    {
+      function();
+    }
+    typename Clock::duration elapsed = Clock::now() - start;
+
+    double ticks = double(elapsed.count()) / iterations;
+    unsigned int thread = omp_get_thread_num();
+    if (owns(thread))
+    {
+      buffers[thread].record_batch(tag.id, ticks, iterations);
+    }
+    else
+    {
+      lock_guard<mutex> lock(shared_lock);
+      locked(thread).record_batch(tag.id, ticks, iterations);
+    }
+    return ticks * clock_scale<Clock>::ns_per_tick();
+  }
+
+  template <class Function>
+  double time_batch(const string &tag, unsigned long int iterations,
+                    Function &&function)
+  {
+    return time_batch(handle(tag), iterations, function);
+  }
+
+  // Benchmark function under tag: warm up for a twentieth of the budget,
+  // double the batch size until the resolution of the clock is below
+  // precision times the duration of a batch (at least a microsecond, at
+  // most a tenth of the budget), then time batches with
+  // time_batch() until the 95% confidence interval of the mean is narrower
+  // than precision times the mean or the budget is used up. At least 10
+  // batches are timed. Use do_not_optimize() on the results computed in
+  // function; memory is clobbered after each call. Returns the statistics
+  // per iteration as aggregate() reports them for this run.
+  template <class Function>
+  statistics benchmark(TagHandle tag, Function &&function,
+                       double precision = 0.01,
+                       milliseconds budget = milliseconds(1000))
+  {
+    auto body = [&]()
+    {
+      function();
+      clobber_memory();
+    };
+    const steady_clock::time_point begin = steady_clock::now();
+    auto elapsed = [&]() { return steady_clock::now() - begin; };
+
+    do
+    {
+      body();
+    } while (elapsed() < budget / 20);
+
+    // Smallest step of the clock
+    const double scale = clock_scale<Clock>::ns_per_tick();
+    double resolution = numeric_limits<double>::max();
+    for (int i = 0; i < 10; i++)
+    {
+      time_point first = Clock::now(), second;
+      while ((second = Clock::now()) == first)
+        ;
+      resolution = std::min(resolution, (second - first).count() * scale);
+    }
+
+    const double target =
+        std::min(std::max(resolution / precision, 1000.0),
+                 duration<double, nano>(budget).count() / 10);
+    unsigned long int size = 1;
+    for (; size < (1ul << 40); size *= 2)
+    {
+      time_point start = Clock::now();
+      for (unsigned long int i = 0; i < size; i++)
+      {
+        body();
+      }
+      if ((Clock::now() - start).count() * scale >= target)
+      {
+        break;
+      }
+    }
+
+    statistics batches = empty; // Batch means, unweighted
+    unsigned long int count = 0;
+    while (true)
+    {
+      update(batches, time_batch(tag, size, body));
+      count++;
+      auto [mean, sst, min, max, n] = batches;
+      double half = 1.96 * sqrt(sst / (count - 1) / count);
+      if (count >= 10 && (2 * half <= precision * mean || elapsed() > budget))
+      {
+        break;
+      }
+    }
+
+    // As aggregate() converts an sst of batch means weighted by size, and
+    // with the overhead of one clock pair per batch if it is subtracted
+    auto [mean, sst, min, max, n] = batches;
+    unsigned long int iterations = count * size;
+    double correction = subtract_overhead ? overhead / size : 0;
+    return {std::max(mean - correction, 0.0),
+            sst * size * (iterations - 1) / (count - 1),
+            std::max(min - correction, 0.0), std::max(max - correction, 0.0),
+            iterations};
+  }
+
+  template <class Function>
+  statistics benchmark(const string &tag, Function &&function,
+                       double precision = 0.01,
+                       milliseconds budget = milliseconds(1000))
+  {
+    return benchmark(handle(tag), function, precision, budget);
+  }
+
+  // Additionally keep the statistics of the last count periods of the given
+  // length, one bucket per period, thread and tag, independent of
+  // aggregate(). A count of 0 disables the windows. Must be
+  // called outside of parallel regions.
+  void windows(nanoseconds length, unsigned int count)
+  {
+    window_length = typename Clock::duration(std::max<long long int>(
+        llround(length.count() / clock_scale<Clock>::ns_per_tick()), 1));
+    window_count = count;
+    for (ThreadBuffer &buffer : buffers)
+    {
+      buffer.windows.assign(count, Window());
+    }
+    for (auto &[thread, buffer] : shared)
+    {
+      buffer.windows.assign(count, Window());
+    }
+  }
+
+  // Statistics of the calls that ended in the current and the count - 1
+  // previous windows: a tumbling window for a count of 1, a sliding one
+  // otherwise. Takes time in the number of threads and tags, not calls.
+  // Must not run concurrently with toc().
+  map<string, statistics> window(unsigned int count = 1) const
+  {
+    map<string, statistics> result;
+    map<string, Histogram> unused;
+    fold(recent(count), result, unused);
+    return result;
+  }
+
+  // Estimate the q-th quantile of tag over the same windows, requires
+  // quantiles
+  double window_quantile(const string &tag, double q,
+                         unsigned int count = 1) const
+  {
+    map<string, statistics> result;
+    map<string, Histogram> estimates;
+    fold(recent(count), result, estimates);
+    auto entry{estimates.find(tag)};
+    auto stats{result.find(tag)};
+    if (entry == end(estimates) || stats == end(result))
+    {
+      return numeric_limits<double>::quiet_NaN();
+    }
+    double min = get<2>(stats->second), max = get<3>(stats->second);
+    return std::min(std::max(entry->second.quantile(q), min), max);
+  }
+
+  // Let threads with their own buffer (see lockfree()) hand their samples
+  // to a background thread through wait-free queues of the given capacity.
+  // The background thread keeps data up to date every interval, which
+  // snapshot() reads at any time. Samples that don't fit into a full queue
+  // are summarised on the producing thread as in streaming mode. Quantiles
+  // are not tracked for queued samples. Must be called outside of parallel
+  // regions.
+  void start_background(milliseconds interval = milliseconds(10),
+                        unsigned long int capacity = 1ul << 14)
+  {
+    stop_background();
+    for (ThreadBuffer &buffer : buffers)
+    {
+      buffer.queue.allocate(capacity);
+    }
+    background = make_unique<Background>();
+    background->interval = interval;
+    background->worker = thread(&BasicCppTimer::consume, this);
+  }
+
+  // Drain the queues one last time and stop the background thread. Must be
+  // called outside of parallel regions.
+  void stop_background()
+  {
+    if (!background)
+    {
+      return;
+    }
+    {
+      lock_guard<mutex> lock(background->lock);
+      background->stop = true;
+    }
+    background->wake.notify_one();
+    background->worker.join();
+    background.reset();
+    for (ThreadBuffer &buffer : buffers)
+    {
+      buffer.queue.release();
+    }
+  }
+
+  // Current statistics without waiting for the workers. Includes what the
+  // background thread has consumed and the last aggregate(). Never blocks
+  // tic, toc or the background thread, so it can be polled from any
+  // thread at any time.
+  map<string, statistics> snapshot() const
+  {
+    vector<statistics> stats = published.read();
+    map<string, statistics> result;
+    for (unsigned int id = 0; id < stats.size(); id++)
+    {
+      if (get<4>(stats[id]) > 0)
+      {
+        result.emplace(name({id}), stats[id]);
+      }
+    }
+    return result;
+  }
+
+  // The same by tag id into by_id, tags without calls have a count of 0.
+  // Reuses the memory of by_id, see CppTimerBase::name() for the tags.
+  void snapshot(vector<statistics> &by_id) const { published.read(by_id); }
+
+  // start a timer - save time
+  void tic(TagHandle tag)
+  {
+    unsigned int thread = omp_get_thread_num();
+
+    if (owns(thread))
+    {
+      start(buffers[thread], tag.id);
+      return;
+    }
+
+    lock_guard<mutex> lock(shared_lock);
+    start(locked(thread), tag.id);
+  }
+
+  // stop a timer - calculate time difference and save key
+  void toc(TagHandle tag)
+  {
+    unsigned int thread = omp_get_thread_num();
+
+    if (owns(thread))
+    {
+      ThreadBuffer &buffer = buffers[thread];
+      if (sampling.empty() || !skip(buffer, tag.id))
+      {
+        stop(buffer, tag.id, thread, Clock::now());
+      }
+      return;
+    }
+
+    time_point now = Clock::now();
+    lock_guard<mutex> lock(shared_lock);
+    ThreadBuffer &buffer = locked(thread);
+    if (sampling.empty() || !skip(buffer, tag.id))
+    {
+      stop(buffer, tag.id, thread, now);
+    }
+  }
+
+  void tic(string &&tag = "tictoc") { tic(handle(tag)); }
+  void toc(string &&tag = "tictoc") { toc(handle(tag)); }
+
+  // Start time of a call, passed from token() to toc() by value
+  struct Token
+  {
+    TagHandle tag;
+    time_point start;
+  };
+
+  // Start timing tag without per-thread state, so that toc(token) can run
+  // on another thread, e.g. at the end of an OpenMP task, and calls of the
+  // same tag can overlap. Tokens bypass sampling, the call tree, the
+  // hardware counters and the allocation tracking.
+  Token token(TagHandle tag) { return {tag, Clock::now()}; }
+  Token token(const string &tag) { return token(handle(tag)); }
+
+  // stop the timer of a token
+  void toc(const Token &token)
+  {
+    time_point now = Clock::now();
+    unsigned int thread = omp_get_thread_num();
+
+    if (owns(thread))
+    {
+      store(buffers[thread], token.tag.id, thread, now - token.start, now);
+      return;
+    }
+
+    lock_guard<mutex> lock(shared_lock);
+    store(locked(thread), token.tag.id, thread, now - token.start, now);
+  }
+
+  // Times the enclosing scope. The start time is kept in the guard, unless
+  // the call needs the per-thread state of tic(), i.e. in hierarchical mode,
+  // with sampling, hardware counters or allocation tracking.
+  class ScopedTimer
+  {
+  private:
+    BasicCppTimer &timer;
+    Token token;
+    bool stateful;
+
+  public:
+    ScopedTimer(BasicCppTimer &timer, TagHandle tag)
+        : timer(timer), token{tag, time_point()},
+          stateful(timer.hierarchical || timer.hardware_counters ||
+                   timer.track_allocations || !timer.sampling.empty())
+    {
+      if (stateful)
+      {
+        timer.tic(tag);
+        return;
+      }
+      token.start = Clock::now();
+    }
+    ScopedTimer(BasicCppTimer &timer, string_view tag = "scoped")
+        : ScopedTimer(timer, handle(tag)) {}
+    ScopedTimer(const ScopedTimer &) = delete;
+    ScopedTimer &operator=(const ScopedTimer &) = delete;
+    ~ScopedTimer()
+    {
+      if (stateful)
+      {
+        timer.toc(token.tag);
+        return;
+      }
+      timer.toc(token);
+    }
+  };
+
+  map<string, statistics> aggregate()
+  {
+    auto lock = guard();
+
+    // Samples are stored in clock ticks and converted here
+    const double scale = clock_scale<Clock>::ns_per_tick();
+
+    vector<ThreadBuffer *> sources;
+    for (ThreadBuffer &buffer : buffers)
+    {
+      sources.push_back(&buffer);
+    }
+    for (auto &[thread, buffer] : shared)
+    {
+      sources.push_back(&buffer);
+    }
+
+    // Split the samples into chunks that are summarised in parallel,
+    // followed by the summaries collected in streaming mode
+    unsigned long int total = 0;
+    for (ThreadBuffer *buffer : sources)
+    {
+      total += buffer->ids.size();
+    }
+    const unsigned long int chunk =
+        std::max(total / (4ul * omp_get_max_threads()) + 1, 1ul << 16);
+    vector<pair<ThreadBuffer *, unsigned long int>> chunks;
+    for (ThreadBuffer *buffer : sources)
+    {
+      for (unsigned long int i = 0; i < buffer->ids.size(); i += chunk)
+      {
+        chunks.emplace_back(buffer, i);
+      }
+    }
+    vector<Partial> partials(chunks.size() + sources.size());
+
+    // The samples ordered by tag id for the passes over histograms, which
+    // work on one tag at a time so that each histogram exists once
+    vector<unsigned long int> starts;
+    vector<double> ordered;
+    if (quantiles || reject_mads > 0)
+    {
+      unsigned int id_count = 0;
+      for (ThreadBuffer *buffer : sources)
+      {
+        for (unsigned int id : buffer->ids)
+        {
+          id_count = std::max(id_count, id + 1);
+        }
+        id_count = std::max(id_count, unsigned(buffer->histograms.size()));
+      }
+      starts.assign(id_count + 1, 0);
+      for (ThreadBuffer *buffer : sources)
+      {
+        for (unsigned long int j = 0; j < buffer->ids.size(); j++)
+        {
+          if (buffer->durations[j] >= 0)
+          {
+            starts[buffer->ids[j] + 1]++;
+          }
+        }
+      }
+      partial_sum(begin(starts), end(starts), begin(starts));
+      ordered.resize(starts.back());
+      vector<unsigned long int> next(begin(starts), end(starts) - 1);
+      for (ThreadBuffer *buffer : sources)
+      {
+        for (unsigned long int j = 0; j < buffer->ids.size(); j++)
+        {
+          if (buffer->durations[j] >= 0)
+          {
+            ordered[next[buffer->ids[j]]++] = buffer->durations[j];
+          }
+        }
+      }
+    }
+    const long int id_count = starts.empty() ? 0 : long(starts.size() - 1);
+
+    // Median and MAD of the MAD rule from the new samples and the earlier
+    // ones, in one histogram per thread
+    if (reject_mads > 0 && id_count > 0)
+    {
+      if (limits.size() < unsigned(id_count))
+      {
+        limits.resize(id_count, {0, numeric_limits<double>::max()});
+      }
+#pragma omp parallel
+      {
+        Histogram counted;
+#pragma omp for schedule(dynamic)
+        for (long int id = 0; id < id_count; id++)
+        {
+          if (starts[id] == starts[id + 1])
+          {
+            continue;
+          }
+          counted.clear();
+          for (unsigned long int j = starts[id]; j < starts[id + 1]; j++)
+          {
+            counted.record(ordered[j] * scale);
+          }
+          auto known{histograms.find(name({unsigned(id)}))};
+          if (known != end(histograms))
+          {
+            counted.merge(known->second);
+          }
+          limit(id, counted);
+        }
+      }
+    }
+
+#pragma omp parallel for schedule(dynamic)
+    for (long int i = 0; i < long(chunks.size()); i++)
+    {
+      auto [buffer, first] = chunks[i];
+      unsigned long int last = std::min(first + chunk, buffer->ids.size());
+      for (unsigned long int j = first; j < last; j++)
+      {
+        if (buffer->durations[j] < 0)
+        {
+          partials[i].needless_tocs.insert(buffer->ids[j]);
+          continue;
+        }
+        if (rejects(partials[i], buffer->ids[j], buffer->durations[j]))
+        {
+          continue;
+        }
+        partials[i].record(buffer->ids[j], buffer->durations[j]);
+      }
+    }
+
+    // The kept samples and the histograms of streaming mode, recorded by
+    // tag straight into the histograms by name
+    if (quantiles && id_count > 0)
+    {
+      vector<Histogram *> targets(id_count, nullptr);
+      for (long int id = 0; id < id_count; id++)
+      {
+        bool counted = starts[id] < starts[id + 1];
+        for (ThreadBuffer *buffer : sources)
+        {
+          counted |= id < long(buffer->histograms.size()) &&
+                     buffer->histograms[id].count() > 0;
+        }
+        if (counted)
+        {
+          targets[id] = &histograms[name({unsigned(id)})];
+        }
+      }
+#pragma omp parallel for schedule(dynamic)
+      for (long int id = 0; id < id_count; id++)
+      {
+        if (!targets[id])
+        {
+          continue;
+        }
+        for (unsigned long int j = starts[id]; j < starts[id + 1]; j++)
+        {
+          if (!rejecting() || kept(id, ordered[j]))
+          {
+            targets[id]->record(ordered[j] * scale);
+          }
+        }
+        for (ThreadBuffer *buffer : sources)
+        {
+          if (id < long(buffer->histograms.size()))
+          {
+            targets[id]->merge(buffer->histograms[id]);
+          }
+        }
+      }
+      // Tags whose samples were all rejected
+      for (long int id = 0; id < id_count; id++)
+      {
+        if (targets[id] && targets[id]->count() == 0)
+        {
+          histograms.erase(name({unsigned(id)}));
+        }
+      }
+    }
+    for (unsigned long int i = 0; i < sources.size(); i++)
+    {
+      Partial &partial = *sources[i];
+      // Copied rather than swapped, so the buffer keeps its pool memory
+      partials[chunks.size() + i].merge(partial, false);
+      partial.clear();
+    }
+
+    reduce(partials);
+
+    if (!partials.empty())
+    {
+      Partial &summary = partials[0];
+      carry(summary);
+      fold(summary, data, histograms);
+      for (unsigned int id : summary.needless_tocs)
+      {
+        needless_tocs.insert(name({id}));
+      }
+      for (unsigned int id = 0; id < summary.rejected.size(); id++)
+      {
+        if (summary.rejected[id])
+        {
+          rejections[name({id})] += summary.rejected[id];
+        }
+      }
+      for (unsigned int id = 0; id < summary.batches.size(); id++)
+      {
+        if (summary.batches[id])
+        {
+          auto &[iterations, batches] = batch_counts[name({id})];
+          iterations += get<4>(summary.batched[id]);
+          batches += summary.batches[id];
+        }
+      }
+    }
+
+    // Limits for the samples that toc() filters until the next call
+    if (reject_mads > 0 && streaming)
+    {
+      for (const auto &[tag, histogram] : histograms)
+      {
+        limit(handle(tag).id, histogram);
+      }
+    }
+
+    // Fold the call trees by path, keeping their structure for open scopes
+    for (ThreadBuffer *buffer : sources)
+    {
+      vector<typename CallTree::Node> &nodes = buffer->tree.nodes;
+      vector<string> path(nodes.size());
+      for (unsigned long int i = 1; i < nodes.size(); i++)
+      {
+        typename CallTree::Node &node = nodes[i];
+        path[i] = (node.parent ? path[node.parent] + "/" : "") +
+                  name({node.tag});
+        if (node.count)
+        {
+          auto &[inclusive, exclusive, count] = paths[path[i]];
+          inclusive += node.inclusive * scale;
+          exclusive += (node.inclusive - node.children) * scale;
+          count += node.count;
+        }
+        node.count = 0, node.inclusive = node.children = 0;
+      }
+    }
+
+    // Means of the counter deltas, merged weighted by the number of calls
+    for (ThreadBuffer *buffer : sources)
+    {
+      for (unsigned int id = 0; id < buffer->counter_calls.size(); id++)
+      {
+        unsigned long int calls = buffer->counter_calls[id];
+        if (calls == 0)
+        {
+          continue;
+        }
+        auto &[cycles, instructions, misses, branches, count] =
+            counter_data.try_emplace(name({id}), 0, 0, 0, 0, 0).first->second;
+        const counter_values &total = buffer->counter_totals[id];
+        double weight = double(calls) / (count + calls);
+        cycles += (double(total[0]) / calls - cycles) * weight;
+        instructions += (double(total[1]) / calls - instructions) * weight;
+        misses += (double(total[2]) / calls - misses) * weight;
+        branches += (double(total[3]) / calls - branches) * weight;
+        count += calls;
+      }
+      buffer->counter_totals.clear(), buffer->counter_calls.clear();
+    }
+
+    for (ThreadBuffer *buffer : sources)
+    {
+      for (unsigned int id = 0; id < buffer->allocation_calls.size(); id++)
+      {
+        unsigned long int calls = buffer->allocation_calls[id];
+        if (calls == 0)
+        {
+          continue;
+        }
+        auto &[bytes, allocations, peak, count] =
+            allocation_data.try_emplace(name({id}), 0, 0, 0, 0)
+                .first->second;
+        const AllocationCounters &total = buffer->allocation_totals[id];
+        double weight = double(calls) / (count + calls);
+        bytes += (double(total.bytes) / calls - bytes) * weight;
+        allocations += (double(total.count) / calls - allocations) * weight;
+        peak = std::max(peak, double(total.peak));
+        count += calls;
+      }
+      buffer->allocation_totals.clear(), buffer->allocation_calls.clear();
+    }
+
+    for (ThreadBuffer *buffer : sources)
+    {
+      for (unsigned int id : buffer->missing_tics)
+      {
+        missing_tics.insert(name({id}));
+      }
+      buffer->ids.clear(), buffer->durations.clear();
+      buffer->missing_tics.clear();
+    }
+
+    // Samples added to tags and durations directly, in nanoseconds
+    for (unsigned long int i = 0; i < tags.size(); i++)
+    {
+      if (durations[i] < 0)
+      {
+        needless_tocs.insert(tags[i]);
+        continue;
+      }
+      update(data.try_emplace(tags[i], empty).first->second, durations[i]);
+      if (quantiles)
+      {
+        histograms[tags[i]].record(durations[i]);
+      }
+    }
+
+    tags.clear(), durations.clear();
+    publish();
+
+    if (!subtract_overhead)
+    {
+      return (data);
+    }
+    map<string, statistics> corrected = data;
+    for (auto &[tag, stats] : corrected)
+    {
+      auto &[mean, sst, min, max, count] = stats;
+      // One clock pair per timed call and per batch, spread over the
+      // iterations of the batch
+      double pairs = count;
+      auto batch{batch_counts.find(tag)};
+      if (batch != end(batch_counts))
+      {
+        auto [iterations, batches] = batch->second;
+        pairs = std::max(pairs - double(iterations) + batches, 0.0);
+      }
+      double correction = count > 0 ? overhead * pairs / count : overhead;
+      mean = std::max(mean - correction, 0.0);
+      min = std::max(min - correction, 0.0);
+      max = std::max(max - correction, 0.0);
+    }
+    return corrected;
+  }
+
+  // Measure the median duration of empty tic/toc pairs with this clock, in
+  // the same mode and on the given number of threads. The result is stored
+  // in overhead. Must be called outside of parallel regions.
+  double calibrate(int threads = omp_get_max_threads(),
+                   unsigned long int pairs = 100000)
+  {
+    BasicCppTimer scratch;
+    if (!buffers.empty())
+    {
+      scratch.lockfree(buffers.size());
+    }
+    scratch.streaming = true;
+    scratch.quantiles = true;
+    TagHandle tag = handle("cpptimer_calibration");
+
+#pragma omp parallel num_threads(threads)
+    for (unsigned long int i = 0; i < pairs; i++)
+    {
+      scratch.tic(tag);
+      scratch.toc(tag);
+    }
+
+    scratch.aggregate();
+    overhead = scratch.quantile("cpptimer_calibration", 0.5);
+    return overhead;
+  }
+
+  using CppTimerBase::merge;
+
+  // Add the statistics of another timer, e.g. the result of its aggregate()
+  void merge(const map<string, statistics> &other)
+  {
+    auto lock = guard();
+    for (const auto &[tag, stats] : other)
+    {
+      merge(data.try_emplace(tag, empty).first->second, stats);
+    }
+    publish();
+  }
+
+  // Add the aggregated statistics and histograms of another timer
+  void merge(const BasicCppTimer &other)
+  {
+    merge(other.data);
+    for (const auto &[tag, histogram] : other.histograms)
+    {
+      histograms[tag].merge(histogram);
+    }
+  }
+
+  // Add the statistics of a dump
+  void merge(const TimerDump &dump) { merge(dump.stats()); }
+
+  // Compare the following aggregates to stats of an earlier run, e.g. the
+  // aggregate() of a nightly build, see regressions()
+  void baseline(const map<string, statistics> &stats) { reference = stats; }
+  void baseline(const TimerDump &dump) { baseline(dump.stats()); }
+
+  // Tags of the last aggregate() whose mean exceeds the one in the baseline
+  // by more than threshold (relative) with a p-value of Welch's t-test
+  // below alpha, slowest change first. Tags with less than two calls in
+  // either run are not compared.
+  vector<Regression> regressions(double threshold = 0.05,
+                                 double alpha = 0.01) const
+  {
+    vector<Regression> result;
+    for (const auto &[tag, stats] : data)
+    {
+      auto entry{reference.find(tag)};
+      if (entry == end(reference))
+      {
+        continue;
+      }
+      auto [mean, sst, min, max, count] = stats;
+      auto [base_mean, base_sst, base_min, base_max, base_count] =
+          entry->second;
+      if (count < 2 || base_count < 2 || !(base_mean > 0) ||
+          mean <= base_mean * (1 + threshold))
+      {
+        continue;
+      }
+      // Squared standard errors of the means
+      double error = sst / (count - 1) / count;
+      double base_error = base_sst / (base_count - 1) / base_count;
+      double total = error + base_error;
+      double t = total > 0 ? (mean - base_mean) / sqrt(total)
+                           : numeric_limits<double>::infinity();
+      double degrees = total > 0 ? total * total /
+                                       (error * error / (count - 1) +
+                                        base_error * base_error /
+                                            (base_count - 1))
+                                 : count + base_count - 2.0;
+      double p = student_upper(t, degrees);
+      if (p < alpha)
+      {
+        result.push_back({tag, base_mean, mean, mean / base_mean - 1, t,
+                          degrees, p});
+      }
+    }
+    sort(begin(result), end(result),
+         [](const Regression &a, const Regression &b)
+         { return a.change > b.change; });
+    return result;
+  }
+
+  // Write the statistics of the last aggregate, the sample log and the trace
+  // to path in the binary format described at DumpHeader
+  void dump(const string &path) const
+  {
+    auto lock = guard();
+
+    // String table of the tags that appear in the dump
+    vector<string> table;
+    map<string, uint32_t> local;
+    auto intern = [&](const string &tag) -> uint32_t
+    {
+      auto [entry, inserted] = local.try_emplace(tag, table.size());
+      if (inserted)
+      {
+        table.push_back(tag);
+      }
+      return entry->second;
+    };
+    vector<uint32_t> by_id; // Local index + 1 of a tag id, 0 if unknown
+    auto intern_id = [&](uint32_t id) -> uint32_t
+    {
+      if (id >= by_id.size())
+      {
+        by_id.resize(id + 1, 0);
+      }
+      if (!by_id[id])
+      {
+        by_id[id] = intern(name({id})) + 1;
+      }
+      return by_id[id] - 1;
+    };
+
+    vector<uint32_t> stat_tag;
+    vector<double> mean, sst, min, max;
+    vector<uint64_t> count;
+    for (const auto &[tag, stats] : data)
+    {
+      stat_tag.push_back(intern(tag));
+      mean.push_back(get<0>(stats)), sst.push_back(get<1>(stats));
+      min.push_back(get<2>(stats)), max.push_back(get<3>(stats));
+      count.push_back(get<4>(stats));
+    }
+
+    vector<uint32_t> sample_tag, sample_thread;
+    vector<uint64_t> sample_duration;
+    for (const Sample &sample : samples())
+    {
+      sample_tag.push_back(intern_id(sample.tag));
+      sample_thread.push_back(sample.thread);
+      sample_duration.push_back(sample.duration);
+    }
+
+    vector<uint32_t> span_tag, span_thread;
+    vector<int64_t> span_start, span_end;
+    auto add_spans = [&](const ThreadBuffer &buffer)
+    {
+      buffer.spans.for_each(
+          [&](const Span &span)
+          {
+            span_tag.push_back(intern_id(span.tag));
+            span_thread.push_back(span.thread);
+            span_start.push_back(clock_scale<Clock>::to_ns(span.start));
+            span_end.push_back(clock_scale<Clock>::to_ns(span.end));
+          });
+    };
+    for (const ThreadBuffer &buffer : buffers)
+    {
+      add_spans(buffer);
+    }
+    for (const auto &[thread, buffer] : shared)
+    {
+      add_spans(buffer);
+    }
+
+    vector<uint64_t> offsets{0};
+    string chars;
+    for (const string &tag : table)
+    {
+      chars += tag;
+      offsets.push_back(chars.size());
+    }
+
+    ofstream out(path, ios::binary);
+    if (!out)
+    {
+      throw runtime_error("cpptimer: can't write " + path);
+    }
+    DumpHeader header{{'C', 'P', 'P', 'T', 'I', 'M', 'E', 'R'},
+                      TimerDump::version,
+                      TimerDump::byte_order,
+                      table.size(),
+                      chars.size(),
+                      stat_tag.size(),
+                      sample_tag.size(),
+                      span_tag.size()};
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    auto write = [&](const auto &column)
+    {
+      const char zeros[8] = {};
+      uint64_t bytes = column.size() * sizeof(column[0]);
+      out.write(reinterpret_cast<const char *>(column.data()), bytes);
+      out.write(zeros, (8 - bytes % 8) % 8);
+    };
+    write(offsets), write(chars);
+    write(stat_tag), write(mean), write(sst), write(min), write(max);
+    write(count);
+    write(sample_tag), write(sample_thread), write(sample_duration);
+    write(span_tag), write(span_thread), write(span_start), write(span_end);
+    if (!out)
+    {
+      throw runtime_error("cpptimer: can't write " + path);
+    }
+  }
+
+  // Inclusive and exclusive time of each call path up to the last aggregate.
+  // The exclusive time of a node excludes the time of its children.
+  const map<string, tree_statistics> &tree() const { return paths; }
+
+  // Hardware counters per call of each tag as of the last aggregate(), see
+  // hardware_counters. Empty if the counters could not be opened.
+  map<string, counter_statistics> counters() const { return counter_data; }
+
+  // Statistics of each tag by thread, CPU and NUMA node, see Breakdown.
+  // Includes all calls since placement was set or the last reset(). Must
+  // not run concurrently with toc().
+  Breakdown breakdown() const
+  {
+    const double scale = clock_scale<Clock>::ns_per_tick();
+    auto scaled = [&](statistics stats)
+    {
+      auto &[mean, sst, min, max, count] = stats;
+      if (count)
+      {
+        mean *= scale, sst *= scale * scale, min *= scale, max *= scale;
+      }
+      return stats;
+    };
+
+    vector<pair<unsigned int, const ThreadBuffer *>> sources;
+    for (unsigned int thread = 0; thread < buffers.size(); thread++)
+    {
+      sources.emplace_back(thread, &buffers[thread]);
+    }
+    for (const auto &[thread, buffer] : shared)
+    {
+      sources.emplace_back(thread.first, &buffer);
+    }
+
+    Breakdown result;
+    unsigned long int rows = 0;
+    for (const auto &[thread, buffer] : sources)
+    {
+      result.threads = std::max(result.threads, thread + 1);
+      rows = std::max(rows, buffer->thread_stats.size());
+    }
+    result.cpus = cpu_count();
+    vector<unsigned int> nodes = cpu_nodes();
+    for (unsigned int node : nodes)
+    {
+      result.nodes = std::max(result.nodes, node + 1);
+    }
+
+    // Keep the rows of tags with calls only
+    vector<unsigned int> row(rows, 0); // Row + 1 by tag id, 0 if none
+    for (const auto &[thread, buffer] : sources)
+    {
+      for (unsigned int id = 0; id < buffer->thread_stats.size(); id++)
+      {
+        if (get<4>(buffer->thread_stats[id]) && !row[id])
+        {
+          result.tags.push_back(name({id}));
+          row[id] = result.tags.size();
+        }
+      }
+    }
+    const size_t tags = result.tags.size();
+    result.by_thread.assign(tags * result.threads, empty);
+    result.by_cpu.assign(tags * result.cpus, empty);
+    result.by_node.assign(tags * result.nodes, empty);
+    for (const auto &[thread, buffer] : sources)
+    {
+      for (unsigned int id = 0; id < buffer->thread_stats.size(); id++)
+      {
+        if (!row[id])
+        {
+          continue;
+        }
+        const size_t r = row[id] - 1;
+        merge(result.by_thread[r * result.threads + thread],
+              scaled(buffer->thread_stats[id]));
+        for (unsigned int cpu = 0; cpu < result.cpus; cpu++)
+        {
+          const size_t index = size_t(id) * result.cpus + cpu;
+          if (index >= buffer->cpu_stats.size())
+          {
+            break;
+          }
+          statistics stats = scaled(buffer->cpu_stats[index]);
+          merge(result.by_cpu[r * result.cpus + cpu], stats);
+          merge(result.by_node[r * result.nodes + nodes[cpu]], stats);
+        }
+      }
+    }
+
+    result.imbalance.resize(tags);
+    for (size_t r = 0; r < tags; r++)
+    {
+      double sum = 0, max = 0;
+      for (unsigned int thread = 0; thread < result.threads; thread++)
+      {
+        const statistics &stats = result.thread(r, thread);
+        double total = get<0>(stats) * get<4>(stats);
+        sum += total, max = std::max(max, total);
+      }
+      result.imbalance[r] = sum > 0 ? max / (sum / result.threads) : 0;
+    }
+    return result;
+  }
+
+  // Heap use per call of each tag as of the last aggregate(), see
+  // track_allocations
+  map<string, allocation_statistics> allocations() const
+  {
+    return allocation_data;
+  }
+
+  // Estimate the q-quantile of a tag from the data of the last aggregate.
+  // NaN if quantiles was not set or the tag has no samples.
+  double quantile(const string &tag, double q) const
+  {
+    auto entry{histograms.find(tag)};
+    auto stats{data.find(tag)};
+    if (entry == end(histograms) || stats == end(data))
+    {
+      return numeric_limits<double>::quiet_NaN();
+    }
+    // Bucket bounds can exceed the observed range
+    double min = get<2>(stats->second), max = get<3>(stats->second);
+    return std::min(std::max(entry->second.quantile(q), min), max);
+  }
+
+  // Estimate the given quantiles of all tags
+  map<string, vector<double>> quantile(const vector<double> &qs) const
+  {
+    map<string, vector<double>> result;
+    for (const auto &[tag, histogram] : histograms)
+    {
+      vector<double> &values = result[tag];
+      for (double q : qs)
+      {
+        values.push_back(quantile(tag, q));
+      }
+    }
+    return result;
+  }
+
+  // Median, MAD and the mean without the shortest and longest fraction trim
+  // of the samples of each tag as of the last aggregate(), estimated from
+  // the histograms (NaN if quantiles isn't set), and the samples rejected,
+  // see reject_mads
+  map<string, robust_statistics> robust(double trim = 0.1) const
+  {
+    const double nan = numeric_limits<double>::quiet_NaN();
+    map<string, robust_statistics> result;
+    for (const auto &[tag, stats] : data)
+    {
+      result[tag] = {nan, nan, nan, 0};
+    }
+    for (const auto &[tag, histogram] : histograms)
+    {
+      auto &[median, mad, trimmed, rejected] = result[tag];
+      median = quantile(tag, 0.5);
+      mad = histogram.mad(histogram.quantile(0.5));
+      trimmed = histogram.trimmed_mean(trim);
+    }
+    for (const auto &[tag, count] : rejections)
+    {
+      auto entry{result.try_emplace(tag, nan, nan, nan, 0).first};
+      get<3>(entry->second) = count;
+    }
+    return result;
+  }
+
+  void reset()
+  {
+    auto lock = guard();
+    if (background)
+    {
+      background->entries.clear();
+    }
+    durations.clear(), tags.clear(), data.clear(), shared.clear();
+    histograms.clear(), paths.clear(), counter_data.clear();
+    allocation_data.clear(), rejections.clear(), limits.clear();
+    batch_counts.clear();
+    pending_skipped.clear();
+    for (ThreadBuffer &buffer : buffers)
+    {
+      buffer.tics.clear(), buffer.ids.clear(), buffer.durations.clear();
+      buffer.missing_tics.clear(), buffer.clear();
+      buffer.samples.clear(), buffer.spans.clear();
+      buffer.tree = CallTree();
+      buffer.calls.clear();
+      buffer.windows.assign(window_count, Window());
+      buffer.counter_tics.clear(), buffer.counter_totals.clear();
+      buffer.counter_calls.clear();
+      buffer.allocation_tics.clear(), buffer.allocation_totals.clear();
+      buffer.allocation_calls.clear();
+      buffer.thread_stats.clear(), buffer.cpu_stats.clear();
+    }
+    publish();
+  }
+};
+
+// Disabled timer. All members are empty and take their arguments as
+// forwarding references, so not even the tag strings are constructed.
+template <class Clock>
+class BasicCppTimer<Clock, false> : public CppTimerBase
+{
+public:
+  vector<string> tags;
+  vector<double> durations;
+  bool verbose = true;
+  bool streaming = false;
+  bool quantiles = false;
+  double overhead = 0;
+  bool subtract_overhead = false;
+  bool hierarchical = false;
+  bool hardware_counters = false;
+  bool placement = false;
+  double reject_mads = 0;
+  double reject_above = numeric_limits<double>::max();
+  bool track_allocations = false;
+
+  template <typename T>
+  BasicCppTimer(T &&) = delete;
+
+  BasicCppTimer() {}
+  BasicCppTimer(bool verbose) : verbose(verbose) {}
+
+  template <class... Args>
+  void lockfree(Args &&...) {}
+  void memory(pmr::memory_resource *) {}
+  template <class... Args>
+  void reserve(Args &&...) {}
+  template <class... Args>
+  void capture(Args &&...) {}
+  vector<Sample> samples() const { return {}; }
+  template <class... Args>
+  void trace(Args &&...) {}
+  void write_trace(ostream &out) const
+  {
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[]}\n";
+  }
+  unsigned long int samples_lost() const { return 0; }
+
+  template <class... Args>
+  void sample_every(Args &&...) {}
+  template <class... Args>
+  void sample_rate(Args &&...) {}
+
+  template <class Tag, class Function>
+  double time_batch(Tag &&, unsigned long int iterations,
+                    Function &&function)
+  {
+    for (unsigned long int i = 0; i < iterations; i++)
+    {
+      function();
+    }
+    return 0;
+  }
+  template <class... Args>
+  statistics benchmark(Args &&...) { return empty; }
+
+  template <class... Args>
+  void tic(Args &&...) {}
+  template <class... Args>
+  void toc(Args &&...) {}
+
+  class ScopedTimer
+  {
+  public:
+    template <class... Args>
+    ScopedTimer(Args &&...) {}
+  };
+
+  struct Token
+  {
+  };
+  template <class... Args>
+  Token token(Args &&...) { return {}; }
+
+  map<string, statistics> aggregate() { return {}; }
+  template <class... Args>
+  void windows(Args &&...) {}
+  map<string, statistics> window(unsigned int = 1) const { return {}; }
+  double window_quantile(const string &, double, unsigned int = 1) const
+  {
+    return numeric_limits<double>::quiet_NaN();
+  }
+  template <class... Args>
+  void start_background(Args &&...) {}
+  void stop_background() {}
+  map<string, statistics> snapshot() const { return {}; }
+  void snapshot(vector<statistics> &by_id) const { by_id.clear(); }
+  template <class... Args>
+  double calibrate(Args &&...) { return 0; }
+  map<string, tree_statistics> tree() const { return {}; }
+  map<string, counter_statistics> counters() const { return {}; }
+  map<string, allocation_statistics> allocations() const { return {}; }
+  Breakdown breakdown() const { return {}; }
+  double quantile(const string &, double) const
+  {
+    return numeric_limits<double>::quiet_NaN();
+  }
+  map<string, vector<double>> quantile(const vector<double> &) const
+  {
+    return {};
+  }
+  map<string, robust_statistics> robust(double = 0.1) const { return {}; }
+
+  using CppTimerBase::merge;
+  void merge(const map<string, statistics> &) {}
+  void merge(const BasicCppTimer &) {}
+  void merge(const TimerDump &) {}
+  template <class... Args>
+  void baseline(Args &&...) {}
+  template <class... Args>
+  vector<Regression> regressions(Args &&...) const
+  {
+    return {};
+  }
+  void dump(const string &) const {}
+  void reset() {}
+};
+
+using CppTimer = BasicCppTimer<>;
+
 #endif
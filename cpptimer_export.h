@@ -0,0 +1,355 @@
+#ifndef cpptimer_export_h
+#define cpptimer_export_h
+
+// Exporters of timer statistics to monitoring systems. Both render into a
+// buffer that is allocated once and reused, and read the timer through
+// snapshot() into a reused array by tag id, so exporting never blocks the
+// timed code and allocates nothing per tag once the tag names are cached.
+
+#include "cpptimer.h"
+
+#include <deque>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CPPTIMER_HAS_SOCKETS
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+namespace cpptimer_export
+{
+  // Names of the tags by id, looked up once since handles never change.
+  // References stay valid while more names are added.
+  class TagNames
+  {
+  private:
+    deque<string> names;
+
+  public:
+    const string &operator[](unsigned int id)
+    {
+      while (names.size() <= id)
+      {
+        names.push_back(CppTimerBase::name({unsigned(names.size())}));
+      }
+      return names[id];
+    }
+  };
+
+  // Shortest text that reads back as value, with the OpenMetrics spelling
+  // of the special values
+  inline int format(char *out, size_t size, double value)
+  {
+    if (isnan(value))
+    {
+      return snprintf(out, size, "NaN");
+    }
+    if (isinf(value))
+    {
+      return snprintf(out, size, value > 0 ? "+Inf" : "-Inf");
+    }
+    return snprintf(out, size, "%.17g", value);
+  }
+}
+
+// Renders statistics as OpenMetrics text, the exposition format of
+// Prometheus. Durations are a summary in nanoseconds with the tag as label,
+// plus gauges for min, max and the standard deviation.
+class OpenMetricsExporter
+{
+private:
+  // Tag, statistics and quantile estimates (or nullptr) of a rendered tag
+  struct Row
+  {
+    const string *tag;
+    statistics stats;
+    const vector<double> *quantiles;
+  };
+
+  string prefix;
+  string text;      // Reused between renders
+  vector<Row> rows; // Reused between renders
+  vector<statistics> by_id;
+  cpptimer_export::TagNames names;
+
+  // Append a sample line, escaping the tag as a label value
+  void line(const char *family, const char *suffix, const string &tag,
+            const char *quantile, const char *value)
+  {
+    text.append(prefix).append(family).append(suffix).append("{tag=\"");
+    for (char c : tag)
+    {
+      if (c == '\\' || c == '"')
+      {
+        text.push_back('\\');
+        text.push_back(c);
+      }
+      else if (c == '\n')
+      {
+        text.append("\\n");
+      }
+      else
+      {
+        text.push_back(c);
+      }
+    }
+    text.push_back('"');
+    if (quantile)
+    {
+      text.append(",quantile=\"").append(quantile).push_back('"');
+    }
+    text.append("} ").append(value).push_back('\n');
+  }
+
+  void line(const char *family, const char *suffix, const string &tag,
+            const char *quantile, double value)
+  {
+    char number[32];
+    cpptimer_export::format(number, sizeof(number), value);
+    line(family, suffix, tag, quantile, number);
+  }
+
+  void family(const char *name, const char *type, const char *help)
+  {
+    text.append("# TYPE ").append(prefix).append(name).append(" ");
+    text.append(type).append("\n# UNIT ").append(prefix).append(name);
+    text.append(" nanoseconds\n# HELP ").append(prefix).append(name);
+    text.append(" ").append(help).append("\n");
+  }
+
+  const string &render_rows(const vector<double> &qs)
+  {
+    text.clear();
+
+    family("_duration_nanoseconds", "summary", "Duration of timed calls.");
+    for (const Row &row : rows)
+    {
+      auto [mean, sst, min, max, count] = row.stats;
+      if (row.quantiles)
+      {
+        for (size_t i = 0; i < qs.size() && i < row.quantiles->size(); i++)
+        {
+          char quantile[32];
+          snprintf(quantile, sizeof(quantile), "%g", qs[i]);
+          line("_duration_nanoseconds", "", *row.tag, quantile,
+               (*row.quantiles)[i]);
+        }
+      }
+      line("_duration_nanoseconds", "_sum", *row.tag, nullptr, mean * count);
+      char calls[24];
+      snprintf(calls, sizeof(calls), "%lu", count);
+      line("_duration_nanoseconds", "_count", *row.tag, nullptr, calls);
+    }
+
+    family("_duration_min_nanoseconds", "gauge", "Shortest timed call.");
+    for (const Row &row : rows)
+    {
+      line("_duration_min_nanoseconds", "", *row.tag, nullptr,
+           get<2>(row.stats));
+    }
+    family("_duration_max_nanoseconds", "gauge", "Longest timed call.");
+    for (const Row &row : rows)
+    {
+      line("_duration_max_nanoseconds", "", *row.tag, nullptr,
+           get<3>(row.stats));
+    }
+    family("_duration_stddev_nanoseconds", "gauge",
+           "Standard deviation of the timed calls.");
+    for (const Row &row : rows)
+    {
+      auto [mean, sst, min, max, count] = row.stats;
+      line("_duration_stddev_nanoseconds", "", *row.tag, nullptr,
+           count > 1 ? sqrt(sst / (count - 1)) : 0);
+    }
+
+    text.append("# EOF\n");
+    return text;
+  }
+
+public:
+  OpenMetricsExporter(string prefix = "cpptimer") : prefix(move(prefix))
+  {
+    text.reserve(1 << 16);
+  }
+
+  // Render stats, and the quantiles qs of each tag if given, e.g. from
+  // BasicCppTimer::quantile(qs). The result is valid until the next call.
+  const string &render(const map<string, statistics> &stats,
+                       const vector<double> &qs = {},
+                       const map<string, vector<double>> &quantiles = {})
+  {
+    rows.clear();
+    for (const auto &[tag, entry] : stats)
+    {
+      auto estimates{quantiles.find(tag)};
+      rows.push_back({&tag, entry,
+                      estimates != end(quantiles) ? &estimates->second
+                                                  : nullptr});
+    }
+    return render_rows(qs);
+  }
+
+  // Render the current statistics of timer, see BasicCppTimer::snapshot()
+  template <class Clock, bool Enabled>
+  const string &render(const BasicCppTimer<Clock, Enabled> &timer)
+  {
+    timer.snapshot(by_id);
+    rows.clear();
+    for (unsigned int id = 0; id < by_id.size(); id++)
+    {
+      if (get<4>(by_id[id]) > 0)
+      {
+        rows.push_back({&names[id], by_id[id], nullptr});
+      }
+    }
+    return render_rows({});
+  }
+};
+
+#ifdef CPPTIMER_HAS_SOCKETS
+// Pushes statistics as StatsD gauges over UDP, batched into datagrams of
+// at most one payload of a typical MTU. For each tag it sends
+// prefix.tag.mean, .min, .max, .stddev (nanoseconds) and .count. Characters
+// with a meaning in the StatsD protocol are replaced in the tag.
+class StatsdExporter
+{
+private:
+  static constexpr size_t payload = 1432;
+  int socket_fd = -1;
+  sockaddr_storage address;
+  socklen_t address_length = 0;
+  string prefix;
+  char datagram[payload];
+  size_t used = 0;
+  vector<statistics> by_id; // Reused between sends
+  cpptimer_export::TagNames names;
+
+  bool flush()
+  {
+    bool sent = used == 0 ||
+                sendto(socket_fd, datagram, used, MSG_DONTWAIT,
+                       reinterpret_cast<sockaddr *>(&address),
+                       address_length) == ssize_t(used);
+    used = 0;
+    return sent;
+  }
+
+  // Gauges can't be NaN or infinite, such values are left out
+  bool metric(const string &tag, const char *name, double value)
+  {
+    char number[32];
+    if (!isfinite(value))
+    {
+      return true;
+    }
+    snprintf(number, sizeof(number), "%.17g", value);
+    return metric(tag, name, number);
+  }
+
+  bool metric(const string &tag, const char *name, const char *value)
+  {
+    char line[payload];
+    size_t length = 0;
+    auto append = [&](const char *text, size_t size)
+    {
+      size = std::min(size, sizeof(line) - length);
+      memcpy(line + length, text, size);
+      length += size;
+    };
+    append(prefix.data(), prefix.size());
+    append(".", 1);
+    for (char c : tag)
+    {
+      char safe = c == ':' || c == '|' || c == '@' || c == '\n' ? '_' : c;
+      append(&safe, 1);
+    }
+    append(".", 1);
+    append(name, strlen(name));
+    append(":", 1);
+    append(value, strlen(value));
+    append("|g\n", 3);
+
+    bool sent = true;
+    if (used + length > payload)
+    {
+      sent = flush();
+    }
+    memcpy(datagram + used, line, length);
+    used += length;
+    return sent;
+  }
+
+  // The gauges of one tag
+  bool gauges(const string &tag, const statistics &stats)
+  {
+    auto [mean, sst, min, max, count] = stats;
+    bool sent = metric(tag, "mean", mean);
+    sent &= metric(tag, "min", min);
+    sent &= metric(tag, "max", max);
+    sent &= metric(tag, "stddev", count > 1 ? sqrt(sst / (count - 1)) : 0);
+    char calls[24];
+    snprintf(calls, sizeof(calls), "%lu", count);
+    return metric(tag, "count", calls) && sent;
+  }
+
+public:
+  StatsdExporter(const string &host = "127.0.0.1",
+                 const string &port = "8125", string prefix = "cpptimer")
+      : prefix(move(prefix))
+  {
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo *found = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0 ||
+        !found)
+    {
+      throw runtime_error("cpptimer: cannot resolve " + host);
+    }
+    socket_fd = socket(found->ai_family, found->ai_socktype,
+                       found->ai_protocol);
+    memcpy(&address, found->ai_addr, found->ai_addrlen);
+    address_length = found->ai_addrlen;
+    freeaddrinfo(found);
+    if (socket_fd < 0)
+    {
+      throw runtime_error("cpptimer: cannot open a UDP socket");
+    }
+  }
+  StatsdExporter(const StatsdExporter &) = delete;
+  StatsdExporter &operator=(const StatsdExporter &) = delete;
+  ~StatsdExporter() { close(socket_fd); }
+
+  // Send stats, returns false if any datagram could not be sent
+  bool send(const map<string, statistics> &stats)
+  {
+    bool sent = true;
+    for (const auto &[tag, entry] : stats)
+    {
+      sent &= gauges(tag, entry);
+    }
+    return flush() && sent;
+  }
+
+  // Send the current statistics of timer, see BasicCppTimer::snapshot()
+  template <class Clock, bool Enabled>
+  bool send(const BasicCppTimer<Clock, Enabled> &timer)
+  {
+    timer.snapshot(by_id);
+    bool sent = true;
+    for (unsigned int id = 0; id < by_id.size(); id++)
+    {
+      if (get<4>(by_id[id]) > 0)
+      {
+        sent &= gauges(names[id], by_id[id]);
+      }
+    }
+    return flush() && sent;
+  }
+};
+#endif
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef cpptimer_mpi_h
+#define cpptimer_mpi_h
+
+// Reduction of the statistics of one timer per MPI rank. Only the tag names
+// and one fixed-size record per tag travel between the ranks, never the
+// samples.
+
+#include "cpptimer.h"
+
+#include <mpi.h>
+
+// Statistics over all ranks: Mean, SST, Min, Max, Count and the imbalance,
+// the largest total time of a rank divided by the mean over all ranks
+using mpi_statistics =
+    tuple<double, double, double, double, unsigned long int, double>;
+
+namespace cpptimer_mpi
+{
+  // Record of a tag reduced by MPI_Reduce. Count is a double so the record
+  // is a contiguous block of MPI_DOUBLE, exact up to 2^53 calls.
+  struct Record
+  {
+    double mean, sst, min, max, count;
+    double total, max_total; // Time spent in the tag by all and one rank
+  };
+
+  // Chan et al.'s pairwise combination, applied element-wise. The operation
+  // is commutative, so MPI may arrange the ranks in any tree.
+  inline void combine(void *in, void *inout, int *length, MPI_Datatype *)
+  {
+    const Record *other = static_cast<const Record *>(in);
+    Record *record = static_cast<Record *>(inout);
+    for (int i = 0; i < *length; i++)
+    {
+      statistics stats{record[i].mean, record[i].sst, record[i].min,
+                       record[i].max, (unsigned long int)record[i].count};
+      CppTimerBase::merge(stats, {other[i].mean, other[i].sst, other[i].min,
+                                  other[i].max,
+                                  (unsigned long int)other[i].count});
+      auto [mean, sst, min, max, count] = stats;
+      record[i].total += other[i].total;
+      record[i].max_total = std::max(record[i].max_total, other[i].max_total);
+      record[i].mean = mean, record[i].sst = sst;
+      record[i].min = min, record[i].max = max, record[i].count = count;
+    }
+  }
+
+  // Union of the tags of all ranks, in the same order on every rank
+  inline vector<string> tags(const map<string, statistics> &local,
+                             MPI_Comm comm)
+  {
+    string names;
+    for (const auto &[tag, stats] : local)
+    {
+      names.append(tag).push_back('\0');
+    }
+    int ranks, length = names.size();
+    MPI_Comm_size(comm, &ranks);
+    vector<int> lengths(ranks), offsets(ranks);
+    MPI_Allgather(&length, 1, MPI_INT, lengths.data(), 1, MPI_INT, comm);
+    int total = 0;
+    for (int rank = 0; rank < ranks; rank++)
+    {
+      offsets[rank] = total;
+      total += lengths[rank];
+    }
+    string all(total, '\0');
+    MPI_Allgatherv(names.data(), length, MPI_CHAR, all.data(),
+                   lengths.data(), offsets.data(), MPI_CHAR, comm);
+
+    set<string> result;
+    for (size_t start = 0; start < all.size();)
+    {
+      size_t end = all.find('\0', start);
+      result.emplace(all, start, end - start);
+      start = end + 1;
+    }
+    return vector<string>(begin(result), end(result));
+  }
+}
+
+// Combine the statistics of all ranks of comm on root. Must be called by
+// all ranks. The result is empty on the other ranks.
+inline map<string, mpi_statistics>
+mpi_aggregate(const map<string, statistics> &local, MPI_Comm comm,
+              int root = 0)
+{
+  using cpptimer_mpi::Record;
+
+  vector<string> tags = cpptimer_mpi::tags(local, comm);
+  map<string, mpi_statistics> result;
+  if (tags.empty())
+  {
+    return result;
+  }
+
+  vector<Record> records(tags.size()), reduced(tags.size());
+  for (size_t i = 0; i < tags.size(); i++)
+  {
+    auto entry{local.find(tags[i])};
+    if (entry == end(local))
+    {
+      records[i] = {0, 0, numeric_limits<double>::max(), 0, 0, 0, 0};
+      continue;
+    }
+    auto [mean, sst, min, max, count] = entry->second;
+    records[i] = {mean, sst, min, max, double(count), mean * count,
+                  mean * count};
+  }
+
+  MPI_Datatype type;
+  MPI_Type_contiguous(sizeof(Record) / sizeof(double), MPI_DOUBLE, &type);
+  MPI_Type_commit(&type);
+  MPI_Op op;
+  MPI_Op_create(&cpptimer_mpi::combine, 1, &op);
+  MPI_Reduce(records.data(), reduced.data(), records.size(), type, op, root,
+             comm);
+  MPI_Op_free(&op);
+  MPI_Type_free(&type);
+
+  int rank, ranks;
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &ranks);
+  if (rank != root)
+  {
+    return result;
+  }
+  for (size_t i = 0; i < tags.size(); i++)
+  {
+    const Record &record = reduced[i];
+    double imbalance =
+        record.total > 0 ? record.max_total / (record.total / ranks) : 0;
+    result[tags[i]] = {record.mean, record.sst, record.min, record.max,
+                       (unsigned long int)record.count, imbalance};
+  }
+  return result;
+}
+
+// Aggregate timer on each rank and combine the results on root
+template <class Clock, bool Enabled>
+map<string, mpi_statistics> mpi_aggregate(BasicCppTimer<Clock, Enabled> &timer,
+                                          MPI_Comm comm, int root = 0)
+{
+  return mpi_aggregate(timer.aggregate(), comm, root);
+}
+
+#endif